@@ -0,0 +1,11 @@
+// Buffer cache statistics, as reported by bcachestat().
+struct bcstat {
+  uint64 nbuf;        // buffers in the cache now
+  uint64 minbuf;      // fewest it shrinks to
+  uint64 maxbuf;      // most it grows to
+  uint64 hits;        // lookups that found the block cached
+  uint64 misses;      // lookups that had to read it
+  uint64 evictions;   // misses that recycled another block's buffer
+  uint64 grows;       // misses that added a buffer
+  uint64 shrinks;     // buffers freed because memory ran out
+};
@@ -1,10 +1,25 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each hash bucket has its own lock, so lookups of different
+// blocks on different harts do not contend. A bucket keeps its
+// buffers most recently released first. A miss, with bcache.lock
+// held so that only one miss at a time moves buffers between
+// buckets, looks at the next few buckets from a clock hand and
+// recycles the unused buffer among them released longest ago.
+// If every buffer is in use and no more can be allocated, the
+// miss sleeps until bput() releases one.
+//
+// Buffers come from a slab cache. While plenty of memory is
+// free, a miss adds a buffer instead of recycling one, up to a
+// quarter of RAM; when kalloc() runs out, it calls breclaim()
+// to give back the added buffers no one is using. The buffers
+// binit() allocates stay, filling whole slabs of their own.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -16,40 +31,166 @@
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "bcstat.h"
 
-struct {
+#define NBUCKET 127
+#define BHASH(dev, blockno) (((dev) * 131 + (blockno)) % NBUCKET)
+#define NSCAN 8   // buckets with unused buffers a miss looks at
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;   // buffers, through prev/next,
+  struct buf *tail;   // most recently released first
+  uint64 hits;        // lookups that found their block here
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;   // held while adding, recycling or freeing buffers
+  struct kmem_cache *cache;
+  int nbuf;               // buffers allocated
+  int minbuf;             // allocated by binit()
+  int maxbuf;             // a miss adds buffers up to this many
+  uint64 growfree;        // and only while more pages than this are free
+  int hand;               // next bucket to look in for a buffer to recycle
+  int nwait;              // misses about to sleep until a buffer is released
+  uint64 misses;
+  uint64 evictions;
+  uint64 grows;
+  uint64 shrinks;
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static void bput(struct buf*);
+
+static void
+bunlink(struct bucket *bk, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bk->head = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+  else
+    bk->tail = b->prev;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->prev = 0;
+  b->next = bk->head;
+  if(bk->head)
+    bk->head->prev = b;
+  else
+    bk->tail = b;
+  bk->head = b;
+}
+
+// Allocate a buffer that holds no block.
+// Returns 0 if out of memory.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  if((b = kmem_cache_alloc(bcache.cache)) == 0)
+    return 0;
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+  return b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  uint64 pages = (phystop - KERNBASE) / PGSIZE;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf));
+
+  // start with one buffer per 4 MB of RAM, but at least NBUF;
+  // grow to a quarter of RAM while an eighth is free.
+  bcache.minbuf = pages / 1024;
+  if(bcache.minbuf < NBUF)
+    bcache.minbuf = NBUF;
+  bcache.maxbuf = pages * PGSIZE / 4 / sizeof(struct buf);
+  if(bcache.maxbuf < bcache.minbuf)
+    bcache.maxbuf = bcache.minbuf;
+  bcache.growfree = pages / 8;
+
+  // spread over the buckets until they are first used.
+  for(i = 0; i < bcache.minbuf; i++){
+    if((b = bnew()) == 0)
+      panic("binit");
+    blink(&bcache.bucket[i % NBUCKET], b);
+  }
+  bcache.nbuf = bcache.minbuf;
+}
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// Find the block in bucket bk, whose lock is held,
+// and take a reference to it.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
   }
+  return 0;
+}
+
+// Take an unused buffer off its bucket to recycle: of the
+// next NSCAN buckets from the clock hand that have one, the
+// buffer released longest ago. Returns 0 if every buffer is
+// in use. Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct bucket *bk, *best = 0;
+  struct buf *b, *victim = 0;
+  int i, seen = 0;
+
+  for(i = 0; i < NBUCKET && seen < NSCAN; i++){
+    bk = &bcache.bucket[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % NBUCKET;
+    acquire(&bk->lock);
+    // the bucket's least recently released unused buffer.
+    for(b = bk->tail; b && b->refcnt > 0; b = b->prev)
+      ;
+    if(b)
+      seen++;
+    // keep the lock of the bucket that holds the victim.
+    if(b && (victim == 0 || b->lastuse < victim->lastuse)){
+      if(best)
+        release(&best->lock);
+      best = bk;
+      victim = b;
+    } else {
+      release(&bk->lock);
+    }
+  }
+  if(victim){
+    bunlink(best, victim);
+    release(&best->lock);
+  }
+  return victim;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +199,133 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
-
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b, *nb = 0;
+  int full = 0;
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0)
+    bk->hits++;
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached. With memory to spare, add a buffer for it;
+  // that is done before taking bcache.lock, since kalloc()
+  // may call breclaim().
+  if(bcache.nbuf < bcache.maxbuf && knfree() > bcache.growfree)
+    nb = bnew();
+
+  acquire(&bcache.lock);
+  for(;;){
+    // Look again once no one else is recycling,
+    // in case someone else has just read it in.
+    acquire(&bk->lock);
+    if((b = bfind(bk, dev, blockno)) != 0)
+      bk->hits++;
+    release(&bk->lock);
+    if(b){
       release(&bcache.lock);
+      if(nb)
+        kmem_cache_free(bcache.cache, nb);
       acquiresleep(&b->lock);
       return b;
     }
+    if(nb){
+      b = nb;
+      b->grown = 1;
+      bcache.nbuf++;
+      bcache.grows++;
+      break;
+    }
+    // Recycle the least recently used (LRU) unused buffer.
+    // nwait is raised before bvictim() looks, so a bput()
+    // that frees a buffer it has passed will wake us.
+    bcache.nwait++;
+    b = bvictim();
+    if(b == 0 && full)
+      sleep(&bcache, &bcache.lock);
+    bcache.nwait--;
+    if(b){
+      bcache.evictions++;
+      break;
+    }
+    if(!full){
+      // every buffer is in use: add one after all, or
+      // else wait for one to be released.
+      release(&bcache.lock);
+      if((nb = bnew()) == 0)
+        full = 1;
+      acquire(&bcache.lock);
+    }
   }
+  bcache.misses++;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  acquire(&bk->lock);
+  blink(bk, b);
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+// Free the buffers that misses added and no one is using,
+// because kalloc() has run out of memory. The pages come back
+// once slabreclaim() finds their slabs empty.
+// Returns the number of buffers freed.
+int
+breclaim(void)
+{
+  struct bucket *bk;
+  struct buf *b, *next;
+  int freed = 0;
+
+  acquire(&bcache.lock);
+  for(bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++){
+    acquire(&bk->lock);
+    for(b = bk->head; b; b = next){
+      next = b->next;
+      if(b->grown && b->refcnt == 0){
+        bunlink(bk, b);
+        kmem_cache_free(bcache.cache, b);
+        freed++;
+      }
     }
+    release(&bk->lock);
   }
-  panic("bget: no buffers");
+  bcache.nbuf -= freed;
+  bcache.shrinks += freed;
+  release(&bcache.lock);
+  return freed;
+}
+
+// Report the size of the cache and how well it does.
+void
+bstat(struct bcstat *st)
+{
+  struct bucket *bk;
+
+  acquire(&bcache.lock);
+  st->nbuf = bcache.nbuf;
+  st->minbuf = bcache.minbuf;
+  st->maxbuf = bcache.maxbuf;
+  st->hits = 0;
+  for(bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++){
+    acquire(&bk->lock);
+    st->hits += bk->hits;
+    release(&bk->lock);
+  }
+  st->misses = bcache.misses;
+  st->evictions = bcache.evictions;
+  st->grows = bcache.grows;
+  st->shrinks = bcache.shrinks;
+  release(&bcache.lock);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,23 +336,169 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    iorw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Fill bp[0..n-1] with locked bufs holding blocks blockno
+// through blockno+n-1, reading those not cached with one disk
+// request per run of them. n is at most MAXCLUSTER.
+void
+bread_range(uint dev, uint blockno, int n, struct buf **bp)
+{
+  int i, j;
+
+  if(n < 1 || n > MAXCLUSTER)
+    panic("bread_range");
+
+  // in block order, as every holder of several buffers must.
+  for(i = 0; i < n; i++)
+    bp[i] = bget(dev, blockno + i);
+
+  for(i = 0; i < n; i = j){
+    for(j = i; j < n && !bp[j]->valid; j++)
+      if(j > i)
+        bp[j-1]->qnext = bp[j];
+    if(j > i)
+      iosubmit(bp[i], 0, 1);
+    else
+      j++;
+  }
+  for(i = 0; i < n; i++){
+    if(!bp[i]->valid){
+      iowait(bp[i]);
+      bp[i]->valid = 1;
+    }
+  }
+}
+
+// Write the locked bufs bp[0..n-1], which hold consecutive
+// blocks, with one disk request.
+void
+bwrite_range(struct buf **bp, int n)
+{
+  int i;
+
+  if(n < 1 || n > MAXCLUSTER)
+    panic("bwrite_range");
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bp[i]->lock))
+      panic("bwrite_range");
+    if(i > 0)
+      bp[i-1]->qnext = bp[i];
+  }
+  iosubmit(bp[0], 1, 1);
+  for(i = 0; i < n; i++)
+    iowait(bp[i]);
+}
+
+// Queue one read request for a run of bufs linked by qnext.
+// Returns -1, releasing them, if wait is 0 and the disk queue
+// is full.
+static int
+bstartrun(struct buf *first, int wait)
+{
+  struct buf *b, *next;
+
+  for(b = first; b; b = b->qnext)
+    b->done = breaddone;
+  if(iosubmit(first, 0, wait) < 0){
+    for(b = first; b; b = next){
+      next = b->qnext;
+      b->qnext = 0;
+      b->done = 0;
+      brelse(b);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+// Queue reads of blocks blockno through blockno+n-1 into the
+// cache, skipping those cached already, and do not wait for
+// them; bkick() starts the disk on the queued reads. Each run
+// of uncached blocks is one request of up to MAXCLUSTER. If
+// wait is 0, gives up rather than wait for room in the disk
+// queue. Returns -1 if it gave up, 0 otherwise.
+int
+breadahead(uint dev, uint blockno, int n, int wait)
+{
+  struct bucket *bk;
+  struct buf *b, *first = 0, *last = 0;
+  int len = 0;
+
+  for(; n > 0; n--, blockno++){
+    bk = &bcache.bucket[BHASH(dev, blockno)];
+    acquire(&bk->lock);
+    for(b = bk->head; b; b = b->next)
+      if(b->dev == dev && b->blockno == blockno)
+        break;
+    release(&bk->lock);
+    if(b == 0){
+      b = bget(dev, blockno);
+      if(b->valid){
+        // someone else read it meanwhile.
+        brelse(b);
+        b = 0;
+      }
+    } else {
+      b = 0;
+    }
+
+    // a cached block, or a full request, ends the run.
+    if(first && (b == 0 || len == MAXCLUSTER)){
+      if(bstartrun(first, wait) < 0){
+        if(b)
+          brelse(b);
+        return -1;
+      }
+      first = 0;
+    }
+    if(b){
+      if(first == 0){
+        first = b;
+        len = 0;
+      } else {
+        last->qnext = b;
+      }
+      last = b;
+      len++;
+    }
+  }
+  if(first && bstartrun(first, wait) < 0)
+    return -1;
+  return 0;
+}
+
+// Let the disk start on the reads breadahead() has queued.
+void
+bkick(void)
+{
+  iokick();
+}
+
+// Called by the disk driver, from the interrupt handler, when
+// a read that breadahead() started has finished.
+void
+breaddone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  iorw(b, 1);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +506,50 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
+// Drop a reference to a buffer. Record when the last one
+// goes, for the choice of buffers to recycle, and wake any
+// miss waiting for a buffer.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+  int freed = 0;
+
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
+    bunlink(bk, b);
+    blink(bk, b);
+    freed = 1;
+  }
+  release(&bk->lock);
+
+  // a waiting miss raised nwait before its bvictim() took
+  // this bucket's lock, so it is seen here; wake it under
+  // bcache.lock, which it holds until it sleeps.
+  if(freed && bcache.nwait > 0){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
   }
-  
-  release(&bcache.lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
 }
-
-
@@ -1,11 +1,15 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  void (*done)(struct buf*); // if set, called when the disk finishes
+  struct buf *qnext; // next block of the same disk request
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks when last released
+  int grown;    // added by a miss, so breclaim() may free it
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
@@ -1,9 +1,14 @@
+struct bcstat;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct kvec;
+struct memstat;
 struct pipe;
 struct proc;
+struct rastate;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -16,6 +21,13 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             breclaim(void);
+void            bstat(struct bcstat*);
+void            bread_range(uint, uint, int, struct buf**);
+void            bwrite_range(struct buf**, int);
+int             breadahead(uint, uint, int, int);
+void            bkick(void);
+void            breaddone(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -25,6 +37,10 @@ void            consputc(int);
 // exec.c
 int             exec(char*, char**);
 
+// fdt.c
+extern uint64   fdtpa;
+uint64          fdtmemtop(void);
+
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
@@ -33,6 +49,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             fileadvise(struct file*, uint, uint, int);
 
 // fs.c
 void            fsinit(int);
@@ -50,6 +67,8 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, struct rastate*, uint, uint);
+void            iwillneed(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -59,23 +78,62 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// iosched.c
+void            ioinit(void);
+int             iosubmit(struct buf*, int, int);
+void            iokick(void);
+void            iowait(struct buf*);
+void            iorw(struct buf*, int);
+void            iodone(int);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kincref(void *);
+int             krefcnt(void *);
+void*           kallocpages(int);
+void            kfreepages(void *, int);
+void*           superalloc(void);
+void            superfree(void *);
+void            kmemstat(struct memstat*);
+uint64          knfree(void);
+
+// ksm.c
+void            ksminit(void);
+void            ksmstat(struct memstat*);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_free(uint);
+int             log_inplace(uint);
 void            begin_op(void);
+int             begin_opn(int);
 void            end_op(void);
 
+// mmap.c
+void            mmapinit(void);
+uint64          mmap(uint64, int, int, int, struct file*, int);
+int             munmap(uint64, int);
+uint64          mmapfault(struct proc*, uint64, int);
+void            mmapprefault(uint64, int, int);
+uint64          mmapbase(struct proc*);
+int             mmapfork(struct proc*, struct proc*);
+void            mmapexit(struct proc*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
 
+// reap.c
+void            reapinit(void);
+void            reapqueue(pagetable_t, uint64);
+int             reap(void);
+
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
@@ -86,7 +144,6 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -115,6 +172,8 @@ void            pop_given(int, int);
 void            pop_specific(int, int);
 void            queue_init(void);
 void            print_queue(int);
+struct proc*    scanvictim(int*, int);
+void            kthread(char*, void (*)(void));
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -127,8 +186,19 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+int             slabreclaim(void);
+void            slabstat(struct memstat*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
@@ -142,6 +212,23 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(int, struct superblock*);
+void            swapdup(uint64);
+void            swapfree(uint64);
+int             swapin(pte_t*);
+void*           ualloc(void);
+void            swapstat(struct memstat*);
+
+// zram.c
+void            zraminit(void);
+uint64          zramstore(void*);
+void            zramload(uint64, void*);
+void            zramdup(uint64);
+void            zramfree(uint64);
+int             zramfull(void);
+void            zramstat(struct memstat*);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -150,6 +237,12 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// text.c
+void            textinit(void);
+uint64          textpage(struct inode*, uint, uint);
+void            textinval(struct inode*);
+int             textreclaim(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -157,6 +250,10 @@ void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
 
+// uaccess.S
+int             uaccesscopy(char*, char*, uint64);
+int             uaccessstr(char*, char*, uint64);
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
@@ -178,9 +275,27 @@ void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+pte_t *         walk(pagetable_t, uint64, int);
+void            asidinit(void);
+uint64          uvmsatp(struct proc*);
+void            asidretire(struct proc*);
+void            tlbfixup(struct proc*, uint64);
+pte_t *         walklevel(pagetable_t, uint64, int, int *);
+void            uvmunmaplazy(pagetable_t, uint64, uint64);
+uint64          uvmmega(pagetable_t, uint64, int);
+int             uvmcopylazy(pagetable_t, pagetable_t, uint64, uint64);
+void            vmstat(pagetable_t, struct memstat*);
+uint64          vmfault(pagetable_t, uint64, int);
+pagetable_t     ukvmcreate(void);
+void            ukvmfree(pagetable_t);
+void            ukvmsync(struct proc*);
+void            kvmswitch(struct proc*);
+int             ukvmfault(uint64, int);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             copyoutv(pagetable_t, uint64, struct kvec*, int);
+int             copyinv(pagetable_t, struct kvec*, int, uint64);
 
 // plic.c
 void            plicinit(void);
@@ -190,7 +305,9 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_start(struct buf *, int, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -3,11 +3,13 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+static int loadtext(pagetable_t, uint64, struct inode *, uint, uint64, uint64, int);
 
 int
 exec(char *path, char **argv)
@@ -48,12 +50,29 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
+    if((ph.vaddr % PGSIZE) != 0)
+      goto bad;
     uint64 sz1;
+    if((ph.flags & ELF_PROG_FLAG_WRITE) == 0 && (ph.off % PGSIZE) == 0 &&
+       ph.vaddr >= PGROUNDUP(sz) && ph.vaddr + ph.memsz < MAXVA){
+      // read-only segment: share its pages with other
+      // processes running this binary.
+      if(ph.vaddr > sz){
+        if((sz1 = uvmalloc(pagetable, sz, ph.vaddr)) == 0)
+          goto bad;
+        sz = sz1;
+      }
+      int perm = PTE_U | PTE_R;
+      if(ph.flags & ELF_PROG_FLAG_EXEC)
+        perm |= PTE_X;
+      if(loadtext(pagetable, ph.vaddr, ip, ph.off, ph.filesz, ph.memsz, perm) < 0)
+        goto bad;
+      sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     sz = sz1;
-    if((ph.vaddr % PGSIZE) != 0)
-      goto bad;
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
@@ -108,13 +127,21 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
+  // Drop mmap()ed regions of the old image, keeping the
+  // swap reclaimer out of it until it is handed to the reapers.
+  acquiresleep(&p->vmlock);
+  mmapexit(p);
+
   // Commit to the user image.
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  asidretire(p);  // the old ASID has translations of the old image
+  ukvmsync(p);    // and the kernel page table maps the old image
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  reapqueue(oldpagetable, oldsz);
+  releasesleep(&p->vmlock);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -138,6 +165,11 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
   uint i, n;
   uint64 pa;
 
+  // start reading all of it, a request per extent on disk,
+  // rather than a page at a time.
+  if(sz > 0)
+    iwillneed(ip, offset, sz);
+
   for(i = 0; i < sz; i += PGSIZE){
     pa = walkaddr(pagetable, va + i);
     if(pa == 0)
@@ -152,3 +184,39 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
   
   return 0;
 }
+
+// Map a read-only program segment at virtual address va,
+// using pages from the shared text cache.
+// va and offset must be page-aligned; the part of the
+// segment past filesz is zero-filled.
+// Returns 0 on success, -1 on failure.
+static int
+loadtext(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset,
+         uint64 filesz, uint64 memsz, int perm)
+{
+  uint64 i, pa;
+  uint n;
+
+  for(i = 0; i < memsz; i += PGSIZE){
+    if(i < filesz){
+      if(filesz - i < PGSIZE)
+        n = filesz - i;
+      else
+        n = PGSIZE;
+      pa = textpage(ip, offset+i, n);
+    } else if((pa = (uint64)kalloc()) != 0){
+      memset((void*)pa, 0, PGSIZE);
+    }
+    if(pa == 0)
+      goto bad;
+    if(mappages(pagetable, va + i, PGSIZE, pa, perm) != 0){
+      kfree((void*)pa);
+      goto bad;
+    }
+  }
+  return 0;
+
+ bad:
+  uvmunmap(pagetable, va, i / PGSIZE, 1);
+  return -1;
+}
@@ -3,3 +3,21 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+// mmap() protection and flags
+#define PROT_NONE      0x0
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define PROT_EXEC      0x4
+
+#define MAP_SHARED     0x01
+#define MAP_PRIVATE    0x02
+#define MAP_ANONYMOUS  0x20
+
+#define MAP_FAILED ((void *) -1)
+
+// fadvise() hints
+#define FADV_NORMAL      0
+#define FADV_SEQUENTIAL  1
+#define FADV_RANDOM      2
+#define FADV_WILLNEED    3
@@ -0,0 +1,120 @@
+//
+// Flattened device tree, as passed by the firmware in a1.
+// Only used to find out how much RAM there is.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC       0xd00dfeed
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+// header at the start of the device tree blob.
+// all fields are big-endian.
+struct fdthdr {
+  uint magic;
+  uint totalsize;
+  uint off_dt_struct;
+  uint off_dt_strings;
+  uint off_mem_rsvmap;
+  uint version;
+  uint last_comp_version;
+  uint boot_cpuid_phys;
+  uint size_dt_strings;
+  uint size_dt_struct;
+};
+
+// physical address of the device tree; set by start().
+uint64 fdtpa;
+
+static uint
+be32(void *p)
+{
+  uchar *b = p;
+  return ((uint)b[0] << 24) | ((uint)b[1] << 16) | ((uint)b[2] << 8) | b[3];
+}
+
+// read a number of ncells 32-bit cells.
+static uint64
+cells(uint *p, int ncells)
+{
+  uint64 x = 0;
+
+  for(int i = 0; i < ncells; i++)
+    x = (x << 32) | be32(p + i);
+  return x;
+}
+
+static int
+strprefix(char *s, char *prefix)
+{
+  return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+// Return the end of the RAM that holds the kernel, according
+// to the memory nodes of the device tree, or 0 if the device
+// tree is missing or has no such node.
+uint64
+fdtmemtop(void)
+{
+  struct fdthdr *h = (struct fdthdr*)fdtpa;
+  uint *p, *end, len;
+  char *strings, *name;
+  int depth = 0, acells = 2, scells = 1, inmem = 0;
+  uint64 top = 0, base, size;
+
+  if(h == 0 || be32(&h->magic) != FDT_MAGIC)
+    return 0;
+
+  p = (uint*)((char*)h + be32(&h->off_dt_struct));
+  end = (uint*)((char*)p + be32(&h->size_dt_struct));
+  strings = (char*)h + be32(&h->off_dt_strings);
+
+  while(p < end){
+    switch(be32(p++)){
+    case FDT_BEGIN_NODE:
+      name = (char*)p;
+      depth++;
+      // memory nodes are children of the root.
+      inmem = depth == 2 && strprefix(name, "memory");
+      p += (strlen(name) + 1 + 3) / 4;
+      break;
+    case FDT_END_NODE:
+      depth--;
+      inmem = 0;
+      break;
+    case FDT_PROP:
+      len = be32(p++);
+      name = strings + be32(p++);
+      if(depth == 1 && strncmp(name, "#address-cells", 15) == 0)
+        acells = be32(p);
+      else if(depth == 1 && strncmp(name, "#size-cells", 12) == 0)
+        scells = be32(p);
+      else if(inmem && strncmp(name, "reg", 4) == 0){
+        // (base, size) pairs; find the range holding the kernel.
+        for(uint i = 0; i + 4*(acells+scells) <= len; i += 4*(acells+scells)){
+          base = cells(p + i/4, acells);
+          size = cells(p + i/4 + acells, scells);
+          if(base <= KERNBASE && KERNBASE < base + size)
+            top = base + size;
+        }
+      }
+      p += (len + 3) / 4;
+      break;
+    case FDT_NOP:
+      break;
+    case FDT_END:
+      return top;
+    default:
+      return 0;
+    }
+  }
+  return top;
+}
@@ -10,19 +10,23 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "fcntl.h"
 #include "stat.h"
 #include "proc.h"
 
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  int nfile;            // files allocated, at most NFILE
 } ftable;
 
+static struct kmem_cache *filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  filecache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -32,15 +36,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.nfile == NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmem_cache_alloc(filecache)) == 0){
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +80,9 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -118,7 +129,9 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    mmapprefault(addr, n, 1);
     ilock(f->ip);
+    readahead(f->ip, &f->ra, f->off, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
@@ -129,6 +142,33 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Tell how file f will be read: advice is one of the
+// FADV_ hints in fcntl.h.
+int
+fileadvise(struct file *f, uint off, uint len, int advice)
+{
+  if(f->type != FD_INODE)
+    return -1;
+
+  switch(advice){
+  case FADV_NORMAL:
+  case FADV_SEQUENTIAL:
+  case FADV_RANDOM:
+    ilock(f->ip);
+    f->ra.advice = advice;
+    f->ra.win = 0;
+    f->ra.ahead = 0;
+    iunlock(f->ip);
+    return 0;
+  case FADV_WILLNEED:
+    ilock(f->ip);
+    iwillneed(f->ip, off, len);
+    iunlock(f->ip);
+    return 0;
+  }
+  return -1;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
@@ -146,20 +186,23 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
+    // reserve log space in proportion to the write, and
+    // write as much as the reservation covers: the data
+    // blocks, in case writei() must log them, an allocation
+    // block for each, and i-node, indirect block, and 2 blocks
+    // of slop for non-aligned writes. a large write may take
+    // several transactions, since one may reserve at most half
+    // the log. this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
     int i = 0;
+    mmapprefault(addr, n, 0);
     while(i < n){
       int n1 = n - i;
+      int nb = (n1 + BSIZE - 1) / BSIZE;
+      int max = ((begin_opn(nb*2 + 1+1+2) - 1-1-2) / 2) * BSIZE;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
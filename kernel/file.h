@@ -1,3 +1,11 @@
+// read-ahead state of an open file; see readahead().
+struct rastate {
+  uint next;   // offset where a sequential read would start
+  uint ahead;  // blocks before this one have been read ahead
+  int win;     // blocks to read ahead, 0 until reads look sequential
+  int advice;  // FADV_ hint from fadvise()
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
   int ref; // reference count
@@ -6,6 +14,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  struct rastate ra; // FD_INODE
   short major;       // FD_DEVICE
 };
 
@@ -18,8 +27,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int text;           // may have pages in the text cache?
 
   short type;         // copy of disk inode
   short major;
@@ -15,11 +15,12 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "fcntl.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -44,6 +45,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -60,7 +62,8 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a disk block. Its contents are stale; writei()
+// fills data blocks, and bmap() zeroes indirect blocks.
 static uint
 balloc(uint dev)
 {
@@ -76,7 +79,6 @@ balloc(uint dev)
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
         return b + bi;
       }
     }
@@ -100,6 +102,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -162,10 +165,12 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable.lock spin-lock protects the list of in-memory
+// inodes. An inode is allocated from a slab cache by iget()
+// and freed when iput() drops its last reference. Since
+// ip->dev and ip->inum indicate which i-node an entry holds,
+// one must hold itable.lock while using ip->ref, ip->dev,
+// ip->inum, or ip->next.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -173,41 +178,44 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *list;   // inodes in memory, linked by next
+  int n;                // length of list, at most NINODE
 } itable;
 
+static struct kmem_cache *inodecache;
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  inodecache = kmem_cache_create("inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if there is no memory for it.
 struct inode*
 ialloc(uint dev, short type)
 {
   int inum;
   struct buf *bp;
   struct dinode *dip;
+  struct inode *ip;
 
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
+      if((ip = iget(dev, inum)) != 0){
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);   // mark it allocated on the disk
+      }
       brelse(bp);
-      return iget(dev, inum);
+      return ip;
     }
     brelse(bp);
   }
@@ -236,37 +244,59 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+// Find the in-memory inode with number inum on device dev,
+// and take a reference to it. itable.lock must be held.
+static struct inode*
+ifind(uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = itable.list; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      ip->ref++;
+      return ip;
+    }
+  }
+  return 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if there is no memory for it.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *nip;
 
+  // Is the inode already in memory?
   acquire(&itable.lock);
+  ip = ifind(dev, inum);
+  release(&itable.lock);
+  if(ip)
+    return ip;
 
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  // Allocate a new one, without itable.lock, since
+  // kalloc() may have to reclaim memory; then look
+  // again, in case someone else has just added it.
+  nip = itable.n < NINODE ? kmem_cache_alloc(inodecache) : 0;
+  acquire(&itable.lock);
+  if((ip = ifind(dev, inum)) != 0 || nip == 0 || itable.n == NINODE){
+    release(&itable.lock);
+    if(nip)
+      kmem_cache_free(inodecache, nip);
+    return ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = nip;
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
-  ip->valid = 0;
+  ip->next = itable.list;
+  itable.list = ip;
+  itable.n++;
   release(&itable.lock);
 
   return ip;
@@ -307,6 +337,9 @@ ilock(struct inode *ip)
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
     ip->valid = 1;
+    // the text cache may still hold pages from an earlier
+    // time this inode was in the table.
+    ip->text = 1;
     if(ip->type == 0)
       panic("ilock: no type");
   }
@@ -323,8 +356,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the in-memory inode
+// is freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -353,7 +386,14 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    struct inode **pp;
+    for(pp = &itable.list; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    itable.n--;
+    kmem_cache_free(inodecache, ip);
+  }
   release(&itable.lock);
 }
 
@@ -389,8 +429,10 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
+    if((addr = ip->addrs[NDIRECT]) == 0){
       ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      bzero(ip->dev, addr);
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
@@ -404,6 +446,50 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Like bmap(), but returns 0 for a block the file does not
+// have instead of allocating one.
+static uint
+bmapget(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT && (addr = ip->addrs[NDIRECT]) != 0){
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn];
+    brelse(bp);
+    return addr;
+  }
+  return 0;
+}
+
+// How many of the blocks from bn on, up to max of them and
+// MAXCLUSTER, lie one after another on the disk? Sets *addr to
+// the disk address of block bn. With alloc, maps blocks the way
+// bmap() does, allocating missing ones; otherwise a missing
+// block ends the extent, and 0 means block bn is missing.
+static int
+iextent(struct inode *ip, uint bn, uint max, int alloc, uint *addr)
+{
+  uint a;
+  int n;
+
+  if(max > MAXCLUSTER)
+    max = MAXCLUSTER;
+  for(n = 0; n < max && bn + n < MAXFILE; n++){
+    a = alloc ? bmap(ip, bn + n) : bmapget(ip, bn + n);
+    if(a == 0 || (n > 0 && a != *addr + n))
+      break;
+    if(n == 0)
+      *addr = a;
+  }
+  return n;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -413,6 +499,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  textinval(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -455,27 +543,142 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, bn, addr;
+  struct buf *bp[MAXCLUSTER];
+  int i, k;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
-      tot = -1;
-      break;
+  // a disk request for each extent of the blocks in range.
+  for(tot=0; tot<n; ){
+    bn = off/BSIZE;
+    k = iextent(ip, bn, (off + n - tot - 1)/BSIZE - bn + 1, 1, &addr);
+    bread_range(ip->dev, addr, k, bp);
+    for(i = 0; i < k; i++, tot+=m, off+=m, dst+=m){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyout(user_dst, dst, bp[i]->data + (off % BSIZE), m) == -1) {
+        for(; i < k; i++)
+          brelse(bp[i]);
+        return -1;
+      }
+      brelse(bp[i]);
     }
-    brelse(bp);
   }
   return tot;
 }
 
+// Read-ahead.
+//
+// A miss in readi() waits for the disk, one block at a time.
+// When an open file is read sequentially, readahead() starts
+// reads of the blocks that come next, so that they are in the
+// buffer cache, or on their way, by the time readi() wants
+// them. The window starts small and doubles with each
+// sequential read; a seek closes it.
+
+#define RAMIN 4    // first window, in blocks
+#define RAMAX 64   // widest window
+
+// Start reading blocks bn up to end of a locked inode, one
+// disk request per extent. Returns the block after the last one
+// started, which is short of end if wait is 0 and the disk
+// queue filled up.
+static uint
+istartread(struct inode *ip, uint bn, uint end, int wait)
+{
+  uint addr;
+  int n;
+
+  while(bn < end){
+    if((n = iextent(ip, bn, end - bn, 0, &addr)) == 0){
+      bn++;
+      continue;
+    }
+    if(breadahead(ip->dev, addr, n, wait) < 0)
+      break;
+    bn += n;
+  }
+  bkick();
+  return bn;
+}
+
+// Called before a read of n bytes at off from an open file
+// whose inode is locked, with the file's read-ahead state.
+void
+readahead(struct inode *ip, struct rastate *ra, uint off, uint n)
+{
+  uint bn, end, nblock;
+
+  if(ra->advice == FADV_RANDOM)
+    return;
+  if(off == ra->next || ra->advice == FADV_SEQUENTIAL){
+    if(ra->advice == FADV_SEQUENTIAL)
+      ra->win = RAMAX;
+    else if(ra->win == 0)
+      ra->win = RAMIN;
+    else if(ra->win < RAMAX)
+      ra->win *= 2;
+  } else {
+    ra->win = 0;
+    ra->ahead = 0;
+  }
+  if(off >= ip->size || ra->win == 0){
+    ra->next = off + n;
+    return;
+  }
+  if(n > ip->size - off)
+    n = ip->size - off;
+  ra->next = off + n;
+
+  // the blocks of this read and win more, skipping
+  // those already started.
+  nblock = (ip->size + BSIZE - 1) / BSIZE;
+  end = (off + n + BSIZE - 1) / BSIZE + ra->win;
+  if(end > nblock)
+    end = nblock;
+  bn = off / BSIZE;
+  if(bn < ra->ahead)
+    bn = ra->ahead;
+  if(bn < end)
+    ra->ahead = istartread(ip, bn, end, 0);
+}
+
+// Start reading len bytes at off of a locked inode, or up to
+// the end of the file if len is 0, for FADV_WILLNEED.
+void
+iwillneed(struct inode *ip, uint off, uint len)
+{
+  if(off >= ip->size)
+    return;
+  if(len == 0 || len > ip->size - off)
+    len = ip->size - off;
+  istartread(ip, off / BSIZE, (off + len + BSIZE - 1) / BSIZE, 1);
+}
+
+// Make the changes to the locked bufs bp[0..n-1], consecutive
+// blocks of ip, part of the transaction. A regular file's data
+// goes straight to disk, in runs, unless log_inplace() objects;
+// directories are metadata and are logged.
+static void
+iwrite(struct inode *ip, struct buf **bp, int n)
+{
+  int i, j;
+
+  for(i = 0; i < n; i = j){
+    for(j = i; j < n && ip->type == T_FILE && log_inplace(bp[j]->blockno); j++)
+      ;
+    if(j > i){
+      bwrite_range(bp + i, j - i);
+    } else {
+      log_write(bp[i]);
+      j++;
+    }
+  }
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -486,25 +689,38 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, bn, addr;
+  struct buf *bp[MAXCLUSTER];
+  int i, j, k;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
-  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-      brelse(bp);
-      break;
+  textinval(ip);
+
+  for(tot=0; tot<n; ){
+    bn = off/BSIZE;
+    k = iextent(ip, bn, (off + n - tot - 1)/BSIZE - bn + 1, 1, &addr);
+    bread_range(ip->dev, addr, k, bp);
+    for(i = 0; i < k; i++, tot+=m, off+=m, src+=m){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyin(bp[i]->data + (off % BSIZE), user_src, src, m) == -1)
+        break;
+      if(off + m >= ip->size && (off + m) % BSIZE)
+        // blocks come from balloc() unzeroed; clear past the end.
+        memset(bp[i]->data + (off + m) % BSIZE, 0, BSIZE - (off + m) % BSIZE);
     }
-    log_write(bp);
-    brelse(bp);
+    iwrite(ip, bp, i);
+    for(j = 0; j < k; j++)
+      brelse(bp[j]);
+    if(i < k)
+      goto out;
   }
 
+out:
+
   if(off > ip->size)
     ip->size = off;
 
@@ -525,11 +741,12 @@ namecmp(const char *s, const char *t)
 }
 
 // Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// If found, set *poff to byte offset of entry, and
+// return its i-number; otherwise return 0.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off;
   struct dirent de;
 
   if(dp->type != T_DIR)
@@ -544,27 +761,36 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       // entry matches path element
       if(poff)
         *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      return de.inum;
     }
   }
 
   return 0;
 }
 
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Returns 0 if there is none, or no memory for its inode.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint inum;
+
+  if((inum = dirfind(dp, name, poff)) == 0)
+    return 0;
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
   struct dirent de;
-  struct inode *ip;
 
   // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  if(dirfind(dp, name, 0) != 0)
     return -1;
-  }
 
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
@@ -630,9 +856,10 @@ namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
-  if(*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
-  else
+  if(*path == '/'){
+    if((ip = iget(ROOTDEV, ROOTINO)) == 0)
+      return 0;
+  } else
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
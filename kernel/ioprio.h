@@ -0,0 +1,4 @@
+// I/O classes, for ionice().
+#define IOCLASS_RT    1  // disk requests go before all others
+#define IOCLASS_BE    2  // best effort: the default
+#define IOCLASS_IDLE  3  // only when the disk has nothing else to do
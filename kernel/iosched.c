@@ -0,0 +1,232 @@
+//
+// Disk request scheduling.
+//
+// The buffer cache and swap hand disk requests to iosubmit()
+// rather than to the driver. A request is a buffer, or a run of
+// buffers for consecutive blocks linked through qnext, as for
+// virtio_disk_start(). At most NINFLIGHT requests are at the
+// device at once; the rest wait here, where a request can merge
+// with a queued one for the blocks next to its own, and where
+// the one to go next is chosen by
+//
+// * class: each process has an I/O class, set with ionice().
+//   realtime requests go before best-effort ones, and idle
+//   ones only go when the disk has nothing else to do.
+// * deadline: within a class, a request that has waited past
+//   its deadline goes first. reads get a short one, since
+//   someone is usually waiting for them; writes a long one.
+// * elevator: otherwise, the request for the lowest block at
+//   or beyond where the disk last was, sweeping upward and
+//   then starting again from the lowest.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "ioprio.h"
+
+#define NIOREQ     64  // requests waiting to go to the device
+#define NINFLIGHT  4   // requests at the device at once
+#define READWAIT   1   // ticks before a queued read goes first
+#define WRITEWAIT  10  // ticks before a queued write goes first
+
+struct ioreq {
+  struct buf *first;   // the blocks, linked through qnext
+  struct buf *last;
+  int n;
+  int write;
+  uint deadline;
+  struct ioreq *next;  // on a queue in block order, or free
+};
+
+struct {
+  struct spinlock lock;
+  struct ioreq req[NIOREQ];
+  struct ioreq *free;
+  struct ioreq *queue[IOCLASS_IDLE+1];  // by class
+  int inflight;        // requests at the device
+  uint head;           // block after the last one sent
+} ios;
+
+void
+ioinit(void)
+{
+  struct ioreq *r;
+
+  initlock(&ios.lock, "iosched");
+  for(r = ios.req; r < &ios.req[NIOREQ]; r++){
+    r->next = ios.free;
+    ios.free = r;
+  }
+}
+
+// Choose the next request to send to the device.
+// Returns the link that points to it, or 0.
+// Caller must hold ios.lock.
+static struct ioreq**
+pick(void)
+{
+  struct ioreq **pp, **best;
+  int c;
+
+  for(c = IOCLASS_RT; c <= IOCLASS_IDLE; c++){
+    if(ios.queue[c] == 0)
+      continue;
+    if(c == IOCLASS_IDLE && ios.inflight > 0)
+      return 0;
+
+    // the longest overdue, if any is.
+    best = 0;
+    for(pp = &ios.queue[c]; *pp; pp = &(*pp)->next){
+      if((int)(ticks - (*pp)->deadline) >= 0 &&
+         (best == 0 || (int)((*pp)->deadline - (*best)->deadline) < 0))
+        best = pp;
+    }
+    if(best)
+      return best;
+
+    // else the next one up from the head.
+    for(pp = &ios.queue[c]; *pp; pp = &(*pp)->next)
+      if((*pp)->first->blockno >= ios.head)
+        return pp;
+    return &ios.queue[c];
+  }
+  return 0;
+}
+
+// Send queued requests to the device while it has room.
+// It is not told about them until virtio_disk_kick().
+// Caller must hold ios.lock.
+static void
+dispatch(void)
+{
+  struct ioreq **pp, *r;
+
+  while(ios.inflight < NINFLIGHT && (pp = pick()) != 0){
+    r = *pp;
+    if(virtio_disk_start(r->first, r->write, 0) < 0)
+      break;
+    *pp = r->next;
+    ios.head = r->last->blockno + 1;
+    ios.inflight++;
+    r->next = ios.free;
+    ios.free = r;
+    wakeup(&ios.free);
+  }
+}
+
+// Queue a read or write of b, which the caller has locked, and
+// of the buffers on its qnext list, which hold the blocks that
+// follow b's. Returns without waiting for it; see iowait(), and
+// virtio_disk_start() for b->done. If wait is 0 and the queue is
+// full, returns -1 instead of waiting for room.
+int
+iosubmit(struct buf *b, int write, int wait)
+{
+  struct proc *p = myproc();
+  int c = p ? p->ioclass : IOCLASS_BE;
+  struct ioreq *r, **pp;
+  struct buf *last, *x;
+  int n = 1;
+
+  for(last = b; last->qnext; last = last->qnext)
+    n++;
+
+  acquire(&ios.lock);
+
+  // a queued request for the blocks just before or after?
+  for(r = ios.queue[c]; r; r = r->next){
+    if(r->write != write || r->first->dev != b->dev || r->n + n > MAXCLUSTER)
+      continue;
+    if(r->last->blockno + 1 == b->blockno){
+      r->last->qnext = b;
+      r->last = last;
+      break;
+    }
+    if(last->blockno + 1 == r->first->blockno){
+      last->qnext = r->first;
+      r->first = b;
+      break;
+    }
+  }
+
+  if(r){
+    r->n += n;
+  } else {
+    while((r = ios.free) == 0){
+      if(!wait){
+        release(&ios.lock);
+        return -1;
+      }
+      // the device must get on with what it has.
+      virtio_disk_kick();
+      sleep(&ios.free, &ios.lock);
+    }
+    ios.free = r->next;
+    r->first = b;
+    r->last = last;
+    r->n = n;
+    r->write = write;
+    r->deadline = ticks + (write ? WRITEWAIT : READWAIT);
+
+    // keep the queue in block order.
+    for(pp = &ios.queue[c]; *pp; pp = &(*pp)->next)
+      if((*pp)->first->blockno > b->blockno)
+        break;
+    r->next = *pp;
+    *pp = r;
+  }
+
+  // so that iowait() waits while the request is queued here.
+  for(x = b; x; x = x->qnext)
+    x->disk = 1;
+
+  dispatch();
+  release(&ios.lock);
+  return 0;
+}
+
+// Let the device start on the requests queued so far.
+void
+iokick(void)
+{
+  acquire(&ios.lock);
+  dispatch();
+  release(&ios.lock);
+  virtio_disk_kick();
+}
+
+// Wait for a request for b, submitted with no b->done, to finish.
+void
+iowait(struct buf *b)
+{
+  iokick();
+  virtio_disk_wait(b);
+}
+
+// Read or write b, and wait for it.
+void
+iorw(struct buf *b, int write)
+{
+  iosubmit(b, write, 1);
+  iowait(b);
+}
+
+// Called by the disk driver, from the interrupt handler, when
+// n requests have finished.
+void
+iodone(int n)
+{
+  acquire(&ios.lock);
+  ios.inflight -= n;
+  dispatch();
+  release(&ios.lock);
+  virtio_disk_kick();
+}
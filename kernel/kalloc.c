@@ -1,6 +1,9 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and slabs of small kernel objects (see slab.c).
+// A binary buddy allocator: hands out physically
+// contiguous blocks of 2^order 4096-byte pages,
+// up to 2 MB megapages for large user regions.
 
 #include "types.h"
 #include "param.h"
@@ -8,6 +11,7 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -16,27 +20,152 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+// Free memory is kept as blocks of 2^order pages, aligned to
+// their size, on one list per order. Freeing a block merges
+// it with its buddy (the other half of the block of the next
+// order up) whenever the buddy is free too. kalloc() takes a
+// single page from the order-0 list, and only splits a larger
+// block when that list is empty.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *free[NORDER];
+  int nfree[NORDER];    // blocks on free[order]
 } kmem;
 
+// end of RAM; see memlayout.h.
+uint64 phystop;
+
+// Reference counts for physical pages, so that a page can be
+// mapped into more than one address space. kalloc() sets the
+// count to one, and kfree() only puts the page back on the
+// free list once the count drops to zero. korder[] holds
+// order+1 for the first page of each free block, 0 otherwise.
+// Both arrays are sized for phystop, and sit between end and
+// kbase.
+static int *kref;
+static uchar *korder;
+static char *kbase;  // first page of the allocation area
+
+#define PA2REF(pa) (&kref[((uint64)(pa) - KERNBASE) / PGSIZE])
+#define PA2ORDER(pa) (&korder[((uint64)(pa) - KERNBASE) / PGSIZE])
+
 void
 kinit()
 {
+  uint64 npages;
+
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+
+  phystop = fdtmemtop();
+  if(phystop == 0)
+    phystop = PHYSTOP;
+  if(phystop > PHYSTOP_MAX)
+    phystop = PHYSTOP_MAX;
+
+  npages = (phystop - KERNBASE) / PGSIZE;
+  kref = (int*)PGROUNDUP((uint64)end);
+  korder = (uchar*)(kref + npages);
+  kbase = (char*)PGROUNDUP((uint64)(korder + npages));
+  memset(kref, 0, kbase - (char*)kref);
+
+  freerange(kbase, (void*)phystop);
+}
+
+// Put a free block on its list.
+// Caller must hold kmem.lock.
+static void
+push(char *pa, int order)
+{
+  struct run *r = (struct run*)pa;
+
+  r->prev = 0;
+  r->next = kmem.free[order];
+  if(r->next)
+    r->next->prev = r;
+  kmem.free[order] = r;
+  kmem.nfree[order]++;
+  *PA2ORDER(pa) = order + 1;
+}
+
+// Take a free block off its list.
+// Caller must hold kmem.lock.
+static void
+unlink(char *pa, int order)
+{
+  struct run *r = (struct run*)pa;
+
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.nfree[order]--;
+  *PA2ORDER(pa) = 0;
 }
 
+// Free a block of 2^order pages, merging it with its
+// buddy as far up as possible.
+static void
+buddyfree(char *pa, int order)
+{
+  char *buddy;
+
+  acquire(&kmem.lock);
+  for(; order < NORDER - 1; order++){
+    buddy = (char*)(KERNBASE + (((uint64)pa - KERNBASE) ^ ((uint64)PGSIZE << order)));
+    if(buddy < kbase || (uint64)buddy >= phystop || *PA2ORDER(buddy) != order + 1)
+      break;
+    unlink(buddy, order);
+    if(buddy < pa)
+      pa = buddy;
+  }
+  push(pa, order);
+  release(&kmem.lock);
+}
+
+// Take a block of 2^order pages, splitting a larger block
+// if there is none of that order.
+// Caller must hold kmem.lock.
+static char*
+buddyalloc(int order)
+{
+  char *pa;
+  int o;
+
+  for(o = order; o < NORDER && kmem.free[o] == 0; o++)
+    ;
+  if(o == NORDER)
+    return 0;
+  pa = (char*)kmem.free[o];
+  unlink(pa, o);
+  // give back the upper halves.
+  while(o > order){
+    o--;
+    push(pa + ((uint64)PGSIZE << o), o);
+  }
+  return pa;
+}
+
+// Free [pa_start, pa_end) in the largest aligned blocks that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  int order;
+
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  while(p + PGSIZE <= (char*)pa_end){
+    for(order = NORDER - 1; order > 0; order--)
+      if(((uint64)p - KERNBASE) % ((uint64)PGSIZE << order) == 0 &&
+         p + ((uint64)PGSIZE << order) <= (char*)pa_end)
+        break;
+    buddyfree(p, order);
+    p += (uint64)PGSIZE << order;
+  }
 }
 
 // Free the page of physical memory pointed at by v,
@@ -46,23 +175,38 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
-  struct run *r;
-
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < kbase || (uint64)pa >= phystop)
     panic("kfree");
 
+  // Drop one reference; only the last one frees the page.
+  int n = __sync_sub_and_fetch(PA2REF(pa), 1);
+  if(n < 0)
+    panic("kfree: ref");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
-  r = (struct run*)pa;
-
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  buddyfree(pa, 0);
 }
 
 // Allocate one 4096-byte page of physical memory.
+// Give back memory that caches hold but can do without.
+// Unused buffers go before slabs, so that slabreclaim() can
+// free the slabs they were the last objects in.
+// Returns how many pages, buffers and slabs were freed.
+static int
+reclaim(void)
+{
+  int n;
+
+  n = textreclaim();
+  n += breclaim();
+  n += slabreclaim();
+  return n;
+}
+
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 void *
@@ -70,13 +214,134 @@ kalloc(void)
 {
   struct run *r;
 
+  // fast path: a page off the order-0 list.
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  if((r = kmem.free[0]) != 0)
+    unlink((char*)r, 0);
+  else
+    r = (struct run*)buddyalloc(0);
   release(&kmem.lock);
 
-  if(r)
+  // out of memory: drop cached text pages no one maps,
+  // and slabs no object lives in.
+  if(r == 0 && reclaim() > 0){
+    acquire(&kmem.lock);
+    r = (struct run*)buddyalloc(0);
+    release(&kmem.lock);
+  }
+
+  if(r){
+    *PA2REF(r) = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Each page has a reference count of one, so the
+// block can also be freed page by page with kfree().
+// Returns 0 if there is no such block.
+void *
+kallocpages(int order)
+{
+  char *pa;
+
+  if(order < 0 || order >= NORDER)
+    panic("kallocpages");
+
+  acquire(&kmem.lock);
+  pa = buddyalloc(order);
+  release(&kmem.lock);
+
+  if(pa == 0 && reclaim() > 0){
+    acquire(&kmem.lock);
+    pa = buddyalloc(order);
+    release(&kmem.lock);
+  }
+
+  if(pa){
+    for(int i = 0; i < (1 << order); i++)
+      *PA2REF(pa + i*PGSIZE) = 1;
+  }
+  return pa;
+}
+
+// Free a block returned by kallocpages() that is still whole,
+// dropping the reference of its first page.
+void
+kfreepages(void *pa, int order)
+{
+  if(((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < kbase || (uint64)pa >= phystop)
+    panic("kfreepages");
+
+  int n = __sync_sub_and_fetch(PA2REF(pa), 1);
+  if(n < 0)
+    panic("kfreepages: ref");
+  if(n > 0)
+    return;
+  for(int i = 1; i < (1 << order); i++)
+    *PA2REF((char*)pa + i*PGSIZE) = 0;
+
+  buddyfree(pa, order);
+}
+
+// Add a reference to the allocated page pa, which will now
+// take one more kfree() to release.
+void
+kincref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < kbase || (uint64)pa >= phystop)
+    panic("kincref");
+  if(__sync_fetch_and_add(PA2REF(pa), 1) < 1)
+    panic("kincref: free page");
+}
+
+// Return the number of references to the page pa.
+int
+krefcnt(void *pa)
+{
+  return *PA2REF(pa);
+}
+
+// Allocate one 2 MB-aligned megapage of physical memory.
+// Returns 0 if there is none; callers fall back to pages.
+void *
+superalloc(void)
+{
+  return kallocpages(MEGAORDER);
+}
+
+// Free a megapage returned by superalloc() that is still
+// whole.
+void
+superfree(void *pa)
+{
+  kfreepages(pa, MEGAORDER);
+}
+
+// Number of free pages, read without the lock,
+// so only a hint.
+uint64
+knfree(void)
+{
+  uint64 n = 0;
+
+  for(int o = 0; o < NORDER; o++)
+    n += (uint64)kmem.nfree[o] << o;
+  return n;
+}
+
+// Report free memory, by block size.
+void
+kmemstat(struct memstat *st)
+{
+  acquire(&kmem.lock);
+  st->freepages = 0;
+  for(int o = 0; o < NORDER; o++){
+    st->freeblocks[o] = kmem.nfree[o];
+    st->freepages += (uint64)kmem.nfree[o] << o;
+  }
+  st->freemega = kmem.nfree[MEGAORDER];
+  release(&kmem.lock);
+}
@@ -0,0 +1,215 @@
+// Same-page merging.
+//
+// The ksmd kernel thread looks through the memory of processes
+// that asked for it with ksm(1), a few pages at a time, and
+// hashes their private pages. When a page has the same contents
+// as a page that is already shared, its PTE is pointed at the
+// shared frame instead, read-only and marked PTE_COW, and the
+// page is freed. A store to it faults, and vmfault() gives the
+// process its own copy again.
+//
+// A page becomes shared the first time a second page with the
+// same hash turns up: that page itself becomes the shared frame.
+// The shared frames are kept in a hash table, holding a
+// reference each; frames that no one else maps any more are
+// dropped.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define NKSMHASH 256   // buckets of shared frames
+#define NSEEN    1024  // recently hashed pages
+#define KSMBATCH 64    // pages hashed per process per pass
+#define KSMPASS  256   // pages hashed per pass
+#define KSMTRY   8     // processes tried per pass
+
+struct ksmpage {
+  uint64 hash;
+  uint64 pa;
+  struct ksmpage *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct ksmpage *bucket[NKSMHASH];
+  struct kmem_cache *cache;
+  int npage;
+} ksm;
+
+// pages hashed lately and not shared, private to ksmd.
+static struct {
+  uint64 hash;
+  uint64 pa;
+} seen[NSEEN];
+
+static uint64
+pagehash(uint64 pa)
+{
+  uint64 *w = (uint64*)pa;
+  uint64 h = 14695981039346656037UL;
+
+  for(int i = 0; i < PGSIZE/8; i++)
+    h = (h ^ w[i]) * 1099511628211UL;
+  return h;
+}
+
+// Map the shared frame pa at pte in place of the page there.
+static void
+share(pte_t *pte, uint64 pa)
+{
+  uint flags = PTE_FLAGS(*pte) & (PTE_R|PTE_X|PTE_U|PTE_A);
+
+  *pte = PA2PTE(pa) | flags | PTE_COW | PTE_V;
+}
+
+// Try to merge the page that pte maps.
+// Returns 1 if the PTE changed.
+// Caller must hold ksm.lock.
+static int
+merge(pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte), h;
+  struct ksmpage *k;
+  int i;
+
+  h = pagehash(pa);
+  for(k = ksm.bucket[h % NKSMHASH]; k; k = k->next){
+    if(k->hash == h && memcmp((void*)k->pa, (void*)pa, PGSIZE) == 0){
+      kincref((void*)k->pa);
+      share(pte, k->pa);
+      kfree((void*)pa);
+      return 1;
+    }
+  }
+
+  i = h % NSEEN;
+  if(seen[i].hash != h || seen[i].pa == pa){
+    seen[i].hash = h;
+    seen[i].pa = pa;
+    return 0;
+  }
+
+  // a second page like this one: share this one.
+  if((k = kmem_cache_alloc(ksm.cache)) == 0)
+    return 0;
+  k->hash = h;
+  k->pa = pa;
+  k->next = ksm.bucket[h % NKSMHASH];
+  ksm.bucket[h % NKSMHASH] = k;
+  ksm.npage++;
+  kincref((void*)pa);
+  share(pte, pa);
+  seen[i].hash = 0;
+  return 1;
+}
+
+// Hash up to KSMBATCH private pages of p, going on from where
+// the last pass stopped. The caller holds p->vmlock, and that
+// alone keeps p out of its page table: were p to run, a fault
+// on a page merged here would block in vmfault() until vmlock
+// is released. Returns the number of pages looked at.
+static int
+scan(struct proc *p)
+{
+  int i, n, level, changed;
+  uint64 va;
+  pte_t *pte;
+
+  n = changed = 0;
+  acquire(&ksm.lock);
+  for(i = 0; i < 4*KSMBATCH && n < KSMBATCH && p->sz > 0; i++){
+    va = p->ksmhand < p->sz ? p->ksmhand : 0;
+    p->ksmhand = va + PGSIZE < p->sz ? va + PGSIZE : 0;
+    pte = walklevel(p->pagetable, va, 0, &level);
+    if(pte == 0 || level != 0 ||
+       (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W) ||
+       krefcnt((void*)PTE2PA(*pte)) != 1)
+      continue;
+    n++;
+    changed |= merge(pte);
+  }
+  release(&ksm.lock);
+  if(changed)
+    asidretire(p);
+  return n;
+}
+
+// Drop shared frames that only the table refers to.
+static void
+prune(void)
+{
+  struct ksmpage **kp, *k;
+
+  acquire(&ksm.lock);
+  for(int b = 0; b < NKSMHASH; b++){
+    for(kp = &ksm.bucket[b]; (k = *kp) != 0; ){
+      if(krefcnt((void*)k->pa) == 1){
+        *kp = k->next;
+        kfree((void*)k->pa);
+        kmem_cache_free(ksm.cache, k);
+        ksm.npage--;
+      } else {
+        kp = &k->next;
+      }
+    }
+  }
+  release(&ksm.lock);
+}
+
+// The body of the ksmd kernel thread.
+void
+ksmd(void)
+{
+  static int lastpid;
+  struct proc *p;
+  int i, n;
+
+  for(;;){
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    prune();
+    for(i = n = 0; i < KSMTRY && n < KSMPASS; i++){
+      if((p = scanvictim(&lastpid, 1)) == 0)
+        continue;
+      n += scan(p);
+      release(&p->lock);
+      releasesleep(&p->vmlock);
+    }
+  }
+}
+
+void
+ksminit(void)
+{
+  initlock(&ksm.lock, "ksm");
+  ksm.cache = kmem_cache_create("ksm", sizeof(struct ksmpage));
+  kthread("ksmd", ksmd);
+}
+
+// Report shared frames, and the pages they save: a frame
+// mapped n times saves n-1 pages.
+void
+ksmstat(struct memstat *st)
+{
+  struct ksmpage *k;
+
+  st->ksmpages = st->ksmsaved = 0;
+  acquire(&ksm.lock);
+  for(int b = 0; b < NKSMHASH; b++){
+    for(k = ksm.bucket[b]; k; k = k->next){
+      st->ksmpages++;
+      if(krefcnt((void*)k->pa) > 2)
+        st->ksmsaved += krefcnt((void*)k->pa) - 2;
+    }
+  }
+  release(&ksm.lock);
+}
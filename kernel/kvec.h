@@ -0,0 +1,5 @@
+// a piece of kernel memory, for copyoutv() and copyinv().
+struct kvec {
+  void *addr;
+  uint64 len;
+};
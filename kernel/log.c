@@ -4,112 +4,258 @@
 #include "param.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction only closes when there are no FS system
+// calls active in it. Thus there is never any reasoning
+// required about whether a commit might write an uncommitted
+// system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the open transaction has been closed.
+//
+// Transactions are committed by the logd kernel thread, not by
+// the system calls. Once no system calls are active in the open
+// transaction, logd closes it: it copies the transaction's
+// blocks from the buffer cache, which takes no disk I/O, and
+// system calls can start on the next transaction straight away
+// while logd writes the copies to disk. logd waits a little
+// before closing a transaction if more system calls keep
+// joining it, so that under parallel load one commit carries
+// the updates of many. end_op() waits until the updates of its
+// system call, if it made any, are committed.
+//
+// Committing is one disk write for the blocks and one for the
+// header. The blocks are installed at their home locations
+// later, by the logckpt kernel thread, once the log is half
+// full or the file system is idle; until then they stay pinned
+// in the buffer cache.
+//
+// The log holds metadata only (ordered mode): FS system calls
+// write the data blocks of regular files straight to their home
+// locations, before the transaction that makes the file point
+// at them commits. log_inplace() says when a block must be
+// logged all the same.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
+// The on-disk log is a ring of slots after the header block:
+//   header block, containing head, n, and block #s for each slot
+//   slot 0
+//   slot 1
 //   ...
-// Log appends are synchronous.
+// The transactions in the log occupy the n slots from slot head
+// onwards, wrapping around, oldest first.
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Contents of the header block.
 struct logheader {
+  int head;
+  int n;
+  int block[MAXLOGSIZE];
+};
+
+#define NLOGFREE 64  // freed blocks a transaction keeps track of
+
+// The block numbers of a transaction.
+struct logtrans {
   int n;
-  int block[LOGSIZE];
+  int block[MAXLOGSIZE];
+  int nfreed;            // blocks it frees, or -1 if too many.
+  uint freed[NLOGFREE];
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // slots in the ring.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int closing;     // logd is copying a transaction, please wait.
+  int full;        // logd is waiting for free slots.
+  int nops;        // FS sys calls that have joined the open transaction.
+  uint seq;        // number of the open transaction.
+  uint committed;  // transactions up to this number are on disk.
   int dev;
-  struct logheader lh;
+  struct logtrans lh;      // the open transaction.
+  struct logtrans commit;  // the transaction logd is committing.
+  // slots are counted from boot; slot pos is at ring slot pos % cap.
+  uint64 head;     // first slot not yet installed.
+  uint64 tail;     // first slot not yet written.
+  uint64 diskhead; // head and tail in the on-disk header.
+  uint64 disktail;
+  int reserved;    // log blocks reserved by outstanding FS sys calls.
+  int home[MAXLOGSIZE];           // each ring slot's home block,
+  struct buf *pinned[MAXLOGSIZE]; // its buffer, pinned in the cache,
+  struct buf *copy[MAXLOGSIZE];   // and its contents when committed.
 };
 struct log log;
 
+#define COMMITROUNDS 4  // times logd waits for more FS sys calls
+
 static void recover_from_log(void);
-static void commit();
+static void logd(void);
+static void logckpt(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
+  struct kmem_cache *cache;
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.cap = log.size - 1;
+  if(log.cap > MAXLOGSIZE)
+    log.cap = MAXLOGSIZE;
+  if(log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  cache = kmem_cache_create("logbuf", sizeof(struct buf));
+  for(i = 0; i < log.cap; i++){
+    if((log.copy[i] = kmem_cache_alloc(cache)) == 0)
+      panic("initlog: out of memory");
+    memset(log.copy[i], 0, sizeof(struct buf));
+  }
   log.dev = dev;
+  log.seq = 1;
   recover_from_log();
+  kthread("logd", logd);
+  kthread("logckpt", logckpt);
 }
 
-// Copy committed blocks from log to their home location
+// Read or write v[0] through v[n-1], buffers for consecutive
+// blocks, with one disk request.
 static void
-install_trans(int recovering)
-{
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+chainio(struct buf **v, int n, int write)
+{
+  int i;
+
+  for (i = 1; i < n; i++)
+    v[i-1]->qnext = v[i];
+  iosubmit(v[0], write, 1);
+  for (i = 0; i < n; i++)
+    iowait(v[i]);
+}
+
+// Read or write the n slots from slot pos onwards, between
+// the ring and log.copy[], MAXCLUSTER slots to a request.
+static void
+logio(uint64 pos, int n, int write)
+{
+  struct buf *v[MAXCLUSTER];
+  int i, k, s;
+
+  for (i = 0; i < n; i += k) {
+    for (k = 0; i + k < n && k < MAXCLUSTER; k++) {
+      s = (pos + i + k) % log.cap;
+      if(k > 0 && s == 0)
+        break;  // wrapped around
+      v[k] = log.copy[s];
+      v[k]->dev = log.dev;
+      v[k]->blockno = log.start + 1 + s;
+    }
+    chainio(v, k, write);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy the slots from pos to end-1 from log.copy[] to their
+// home locations, in block order, a disk request for each run
+// of consecutive home blocks. A block logged more than once
+// is written only from its last slot.
+static void
+install_trans(uint64 pos, uint64 end)
+{
+  struct buf *v[MAXCLUSTER];
+  int order[MAXLOGSIZE];
+  int i, j, k, n, s;
+
+  n = 0;
+  for (; pos < end; pos++) {
+    s = pos % log.cap;
+    for (i = 0; i < n && log.home[order[i]] < log.home[s]; i++)
+      ;
+    if(i < n && log.home[order[i]] == log.home[s]){
+      order[i] = s;  // a later copy
+      continue;
+    }
+    for (j = n; j > i; j--)
+      order[j] = order[j-1];
+    order[i] = s;
+    n++;
+  }
+
+  for (i = 0; i < n; i += k) {
+    for (k = 0; i + k < n && k < MAXCLUSTER; k++) {
+      s = order[i+k];
+      if(k > 0 && log.home[s] != log.home[order[i]] + k)
+        break;
+      v[k] = log.copy[s];
+      v[k]->dev = log.dev;
+      v[k]->blockno = log.home[s];
+    }
+    chainio(v, k, 1);  // write dst to disk
+  }
+}
+
+// Read the log header from disk.
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  int i, s;
+
+  log.head = log.diskhead = lh->head;
+  log.tail = log.disktail = lh->head + lh->n;
+  for (i = 0; i < lh->n; i++) {
+    s = (lh->head + i) % log.cap;
+    log.home[s] = lh->block[s];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write a header for the slots from log.head to log.tail,
+// which are on disk. This is the true point at which a
+// transaction commits, and after which the slots of installed
+// transactions can be reused.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  uint64 head, tail, pos;
+
+  acquire(&log.lock);
+  head = log.head;
+  tail = log.tail;
+  hb->head = head % log.cap;
+  hb->n = tail - head;
+  for (pos = head; pos < tail; pos++)
+    hb->block[pos % log.cap] = log.home[pos % log.cap];
+  release(&log.lock);
+
   bwrite(buf);
+
+  acquire(&log.lock);
+  if(head > log.diskhead){
+    log.diskhead = head;
+    wakeup(&log.diskhead);
+  }
+  if(tail > log.disktail){
+    log.disktail = tail;
+    wakeup(&log.disktail);
+  }
+  release(&log.lock);
   brelse(buf);
 }
 
@@ -117,8 +263,9 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  logio(log.head, log.tail - log.head, 0);  // read the log slots
+  install_trans(log.head, log.tail); // if committed, copy from log to disk
+  log.head = log.tail;
   write_head(); // clear the log
 }
 
@@ -126,85 +273,201 @@ recover_from_log(void)
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called instead of begin_op() by an FS system call that may
+// log more than MAXOPBLOCKS blocks, up to n. reserves log space
+// for n blocks, but no more than half the log, and returns
+// how many blocks it reserved.
+int
+begin_opn(int n)
+{
+  if(n > log.cap / 2)
+    n = log.cap / 2;
+  if(n < MAXOPBLOCKS)
+    n = MAXOPBLOCKS;
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.reserved + n > log.cap){
+      // this op might exhaust log space; wait for logd
+      // to close the transaction.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.nops += 1;
+      log.reserved += n;
+      myproc()->logres = n;
       release(&log.lock);
-      break;
+      return n;
     }
   }
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// waits until what it wrote, if anything, is committed.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct proc *p = myproc();
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
+  log.reserved -= p->logres;
+  p->logres = 0;
+  if(log.closing)
+    panic("log.closing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+    // logd may close the transaction now.
+    wakeup(&log.outstanding);
   }
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
+  while((int)(log.committed - p->logseq) < 0)
+    sleep(&log.committed, &log.lock);
   release(&log.lock);
-
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the closed transaction's blocks from the buffer cache,
+// where they stay pinned until installed, to the slots from
+// slot pos onwards in log.copy[]. Later transactions may
+// change the cached blocks while the copies are written.
 static void
-write_log(void)
+copy_trans(uint64 pos)
 {
-  int tail;
+  int tail, s;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (tail = 0; tail < log.commit.n; tail++) {
+    struct buf *from = bread(log.dev, log.commit.block[tail]); // cache block
+    s = (pos + tail) % log.cap;
+    memmove(log.copy[s]->data, from->data, BSIZE);
+    log.home[s] = log.commit.block[tail];
+    log.pinned[s] = from;
     brelse(from);
-    brelse(to);
   }
 }
 
+// The log's kernel thread: closes and commits transactions.
 static void
-commit()
+logd(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  uint seq;
+  uint64 pos;
+  int i, nops;
+
+  acquire(&log.lock);
+  for(;;){
+    // wait for a transaction with updates in it and
+    // no FS sys calls still executing.
+    if(log.lh.n == 0 || log.outstanding > 0){
+      sleep(&log.outstanding, &log.lock);
+      continue;
+    }
+
+    // group commit: give other processes a chance to join the
+    // transaction while the log has room, and if any do, wait
+    // for them to finish and try again.
+    for(i = 0; i < COMMITROUNDS && log.lh.n + MAXOPBLOCKS <= log.cap; i++){
+      nops = log.nops;
+      release(&log.lock);
+      yield();
+      acquire(&log.lock);
+      while(log.outstanding > 0)
+        sleep(&log.outstanding, &log.lock);
+      if(log.nops == nops)
+        break;
+    }
+
+    // close it; the next FS sys call starts a new one.
+    log.commit = log.lh;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.lh.nfreed = 0;
+    log.nops = 0;
+    seq = log.seq++;
+    log.closing = 1;
+
+    // wait for logckpt to free enough slots.
+    while(log.tail + log.commit.n - log.diskhead > log.cap){
+      log.full = 1;
+      wakeup(&log.disktail);
+      sleep(&log.diskhead, &log.lock);
+    }
+    log.full = 0;
+    pos = log.tail;
+    release(&log.lock);
+
+    copy_trans(pos);
+
+    acquire(&log.lock);
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    logio(pos, log.commit.n, 1);  // Write the copies to the log
+
+    acquire(&log.lock);
+    log.tail = pos + log.commit.n;
+    release(&log.lock);
+
+    write_head();    // Write header to disk -- the real commit
+
+    acquire(&log.lock);
+    log.committed = seq;
+    log.commit.n = 0;  // its blocks are in the ring now
+    log.commit.nfreed = 0;
+    wakeup(&log.committed);
+  }
+}
+
+// The checkpoint kernel thread: installs committed transactions
+// at their home locations, and frees their slots.
+static void
+logckpt(void)
+{
+  uint64 head, end, pos;
+  struct buf *b;
+  int s;
+
+  acquire(&log.lock);
+  for(;;){
+    // wait for committed transactions, and for the log to be
+    // half full, logd to need slots, or no open updates.
+    if(log.disktail == log.head ||
+       (log.disktail - log.diskhead <= log.cap/2 && !log.full && log.lh.n > 0)){
+      sleep(&log.disktail, &log.lock);
+      continue;
+    }
+    head = log.head;
+    end = log.disktail;
+    release(&log.lock);
+
+    install_trans(head, end);
+    for (pos = head; pos < end; pos++) {
+      s = pos % log.cap;
+      if((b = log.pinned[s]) != 0){
+        log.pinned[s] = 0;
+        bunpin(b);
+      }
+    }
+
+    acquire(&log.lock);
+    log.head = end;
+    release(&log.lock);
+
+    write_head();    // Erase the installed transactions from the log
+
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// logd and logckpt will do the disk writes.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +480,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -231,6 +494,55 @@ log_write(struct buf *b)
     bpin(b);
     log.lh.n++;
   }
+  myproc()->logseq = log.seq;
+  release(&log.lock);
+}
+
+// Record that the open transaction frees block blockno.
+void
+log_free(uint blockno)
+{
+  acquire(&log.lock);
+  if(log.lh.nfreed >= NLOGFREE)
+    log.lh.nfreed = -1;
+  else if(log.lh.nfreed >= 0)
+    log.lh.freed[log.lh.nfreed++] = blockno;
   release(&log.lock);
 }
 
+// Does t log or free block blockno?
+static int
+trans_has(struct logtrans *t, uint blockno)
+{
+  int i;
+
+  if(t->nfreed < 0)
+    return 1;
+  for (i = 0; i < t->n; i++)
+    if(t->block[i] == blockno)
+      return 1;
+  for (i = 0; i < t->nfreed; i++)
+    if(t->freed[i] == blockno)
+      return 1;
+  return 0;
+}
+
+// May the open transaction write the data block blockno to its
+// home location rather than log it? Not if the log holds a copy
+// that would be installed over it later, and not if a transaction
+// that is not yet committed frees it, since after a crash the
+// block would still belong to its old file.
+int
+log_inplace(uint blockno)
+{
+  uint64 pos;
+  int ok;
+
+  acquire(&log.lock);
+  ok = !trans_has(&log.lh, blockno) && !trans_has(&log.commit, blockno);
+  for (pos = log.head; ok && pos < log.tail; pos++)
+    if(log.home[pos % log.cap] == blockno)
+      ok = 0;
+  release(&log.lock);
+  return ok;
+}
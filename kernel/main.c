@@ -18,18 +18,27 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small kernel objects
+    zraminit();      // compressed swap
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    asidinit();      // address-space identifiers
     procinit(); // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    ioinit();        // disk request scheduler
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipes
+    textinit();      // shared text pages
+    mmapinit();      // shared file mappings
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    ksminit();       // page merging thread
+    reapinit();      // address-space teardown threads
     __sync_synchronize();
     started = 1;
   } else {
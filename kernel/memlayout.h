@@ -14,8 +14,8 @@
 
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
-// end -- start of kernel page allocation area
-// PHYSTOP -- end RAM used by the kernel
+// end -- page reference counts, then the kernel page allocation area
+// phystop -- end RAM used by the kernel
 
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
@@ -43,16 +43,26 @@
 
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
-// from physical address 0x80000000 to PHYSTOP.
+// from physical address 0x80000000 to phystop,
+// which is taken from the device tree's memory node.
+// PHYSTOP is used if the device tree says nothing,
+// and at most PHYSTOP_MAX is used.
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
+#define PHYSTOP_MAX (KERNBASE + 16L*1024*1024*1024)
+extern uint64 phystop;
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
+// user memory below UKVMTOP is mapped in the process's
+// kernel page table as well, under the devices; see ukvmcreate().
+#define UKVMTOP PLIC
+
 // map kernel stacks beneath the trampoline,
 // each surrounded by invalid guard pages.
+// there are NPROC slots; see allocproc().
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
 // User memory layout.
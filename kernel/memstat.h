@@ -0,0 +1,22 @@
+#define NORDER 10     // block sizes of the page allocator: 2^0 .. 2^9 pages
+
+// Memory statistics, as reported by memstat().
+struct memstat {
+  uint64 freepages;   // free 4096-byte pages, counting free megapages
+  uint64 freemega;    // free 2 MB megapages
+  uint64 freeblocks[NORDER]; // free blocks of 2^order pages
+  uint64 ptpages;     // page-table pages of the calling process
+  uint64 megapages;   // megapages mapped by the calling process
+  uint64 kptpages;    // page-table pages of the kernel page table
+  uint64 kmegapages;  // megapages mapped by the kernel page table
+  uint64 slabpages;   // pages held by the slab allocator
+  uint64 swapslots;   // page-sized slots in the swap area
+  uint64 swapused;    // slots holding swapped-out pages on disk
+  uint64 swapins;     // pages read back from swap since boot
+  uint64 swapouts;    // pages evicted to swap since boot
+  uint64 zrampages;   // swapped-out pages kept compressed in memory
+  uint64 zrambytes;   // their compressed size
+  uint64 zrampool;    // bytes of memory holding them
+  uint64 ksmpages;    // frames shared by page merging
+  uint64 ksmsaved;    // pages that merging saves
+};
@@ -0,0 +1,543 @@
+//
+// Memory-mapped files and anonymous memory: mmap() and munmap().
+//
+// Each process has a small table of vmas describing the regions
+// it has mapped. Regions are placed top-down beneath the trapframe.
+// Pages of a region are only allocated when first touched, by
+// mmapfault(), which reads file-backed pages straight from the
+// inode.
+//
+// All MAP_SHARED mappings of a file page, in any process, map
+// the same physical page, so they see each other's stores at
+// once. A table keyed by inode and offset finds the page; it
+// holds a reference to it until no process maps it any more.
+// Dirty pages of MAP_SHARED file mappings are written back to
+// the file by munmap() and when the process exits. read() and
+// write() go to the file, not to these pages, so they see
+// stores to a mapping only once it has been written back.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define NSHBUCKET 61
+
+// A physical page that MAP_SHARED mappings of a file share.
+struct shpage {
+  uint dev;
+  uint inum;
+  uint off;             // file offset of the page
+  uint64 pa;
+  struct shpage *next;  // in the hash bucket
+};
+
+struct {
+  struct spinlock lock;
+  struct shpage *bucket[NSHBUCKET];
+  struct kmem_cache *cache;
+} shared;
+
+#define SHHASH(ip, off) (((ip)->inum * 131 + (off) / PGSIZE) % NSHBUCKET)
+
+void
+mmapinit(void)
+{
+  initlock(&shared.lock, "mmapshared");
+  shared.cache = kmem_cache_create("shpage", sizeof(struct shpage));
+}
+
+// Find the shared page of ip at off, and take a reference to
+// it for a new mapping. Caller must hold shared.lock.
+static uint64
+shlookup(struct inode *ip, uint off)
+{
+  struct shpage *s;
+
+  for(s = shared.bucket[SHHASH(ip, off)]; s; s = s->next){
+    if(s->dev == ip->dev && s->inum == ip->inum && s->off == off){
+      kincref((void*)s->pa);
+      return s->pa;
+    }
+  }
+  return 0;
+}
+
+// Drop the shared pages of ip that no process maps.
+static void
+shdrop(struct inode *ip)
+{
+  struct shpage *s, **sp;
+  int i;
+
+  acquire(&shared.lock);
+  for(i = 0; i < NSHBUCKET; i++){
+    for(sp = &shared.bucket[i]; (s = *sp) != 0; ){
+      if(s->dev == ip->dev && s->inum == ip->inum && krefcnt((void*)s->pa) == 1){
+        *sp = s->next;
+        kfree((void*)s->pa);
+        kmem_cache_free(shared.cache, s);
+      } else {
+        sp = &s->next;
+      }
+    }
+  }
+  release(&shared.lock);
+}
+
+// PTE permission bits for the pages of v.
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Return the vma of p that contains va, or 0.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->used && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address used by any mapping of p,
+// i.e. the limit up to which the heap may grow.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->used && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Is [addr, addr+len) free for a mapping of p?
+static int
+vmafree(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v;
+
+  if(addr < PGROUNDUP(p->sz) || addr + len < addr || addr + len > TRAPFRAME)
+    return 0;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->used && v->addr < addr + len && v->addr + v->len > addr)
+      return 0;
+  return 1;
+}
+
+// Find room for len bytes of mappings: at hint, if it is
+// page-aligned and free, or else searching down from the
+// trapframe. Regions of 2 MB or more found that way are
+// aligned so that they can use megapages. Returns 0 if there
+// is no gap large enough.
+static uint64
+vmaplace(struct proc *p, uint64 hint, uint64 len)
+{
+  struct vma *v;
+  uint64 addr, end = TRAPFRAME;
+
+  if(hint != 0 && (hint % PGSIZE) == 0 && vmafree(p, hint, len))
+    return hint;
+
+again:
+  if(len > end)
+    return 0;
+  addr = end - len;
+  if(len >= MEGASIZE)
+    addr = MEGAROUNDDOWN(addr);
+  if(addr < PGROUNDUP(p->sz))
+    return 0;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(v->used && v->addr < addr + len && v->addr + v->len > addr){
+      end = v->addr;
+      goto again;
+    }
+  }
+  return addr;
+}
+
+// Read the file page of v that backs va into mem.
+static void
+vmaread(struct vma *v, uint64 va, char *mem)
+{
+  struct inode *ip = v->f->ip;
+
+  ilock(ip);
+  readi(ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+  iunlock(ip);
+}
+
+// Return a referenced page holding the file page of the
+// MAP_SHARED file mapping v at va, the one every such mapping
+// of it shares. Returns 0 if out of memory.
+static char*
+vmashared(struct vma *v, uint64 va)
+{
+  struct inode *ip = v->f->ip;
+  uint off = v->off + (va - v->addr);
+  struct shpage *s;
+  uint64 pa;
+  char *mem;
+
+  acquire(&shared.lock);
+  pa = shlookup(ip, off);
+  release(&shared.lock);
+  if(pa)
+    return (char*)pa;
+
+  // read it in without the lock, then look again, in case
+  // another process has just done the same.
+  if((mem = ualloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  vmaread(v, va, mem);
+  s = kmem_cache_alloc(shared.cache);
+  acquire(&shared.lock);
+  if((pa = shlookup(ip, off)) != 0 || s == 0){
+    release(&shared.lock);
+    kfree(mem);
+    if(s)
+      kmem_cache_free(shared.cache, s);
+    return (char*)pa;
+  }
+  s->dev = ip->dev;
+  s->inum = ip->inum;
+  s->off = off;
+  s->pa = (uint64)mem;
+  s->next = shared.bucket[SHHASH(ip, off)];
+  shared.bucket[SHHASH(ip, off)] = s;
+  kincref(mem);  // the table's reference
+  release(&shared.lock);
+  return mem;
+}
+
+// Allocate and map the page of v at va.
+// Returns the physical address, or 0 if out of memory.
+static uint64
+vmapopulate(struct proc *p, struct vma *v, uint64 va)
+{
+  char *mem;
+
+  if(v->f && (v->flags & MAP_SHARED)){
+    if((mem = vmashared(v, va)) == 0)
+      return 0;
+  } else {
+    if((mem = ualloc()) == 0)
+      return 0;
+    memset(mem, 0, PGSIZE);
+    if(v->f)
+      vmaread(v, va, mem);
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, vmaperm(v)) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Handle a page fault at va, which is not mapped in p's page
+// table. Returns the physical address of the new page, or 0
+// if va is not part of a mapping that allows the access.
+uint64
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  uint64 base, pa;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmalookup(p, va)) == 0)
+    return 0;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return 0;
+  if(!write && (v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return 0;
+
+  // private anonymous memory gets a whole megapage at
+  // once if the region covers it.
+  base = MEGAROUNDDOWN(va);
+  if(v->f == 0 && (v->flags & MAP_PRIVATE) &&
+     base >= v->addr && base + MEGASIZE <= v->addr + v->len &&
+     (pa = uvmmega(p->pagetable, base, vmaperm(v))) != 0)
+    return pa + (va - base);
+
+  return vmapopulate(p, v, va);
+}
+
+// Fault in the mmap()ed pages of [addr, addr+n) before
+// fileread() or filewrite() lock an inode and its buffers,
+// since the mapping may be of that very file.
+void
+mmapprefault(uint64 addr, int n, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint64 a;
+
+  if(n <= 0 || addr + n < addr || addr + n > MAXVA)
+    return;
+  acquiresleep(&p->vmlock);
+  for(a = PGROUNDDOWN(addr); a < addr + n; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V))
+      continue;
+    if(vmalookup(p, a))
+      mmapfault(p, a, write);
+  }
+  releasesleep(&p->vmlock);
+}
+
+// Write the dirty pages of [va, va+len) of a MAP_SHARED file
+// mapping back to the file. Pages beyond the end of the file
+// are not written, so the file never grows.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  uint64 a;
+  uint off, n;
+  pte_t *pte;
+
+  if((v->flags & MAP_SHARED) == 0 || (v->prot & PROT_WRITE) == 0)
+    return;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    off = v->off + (a - v->addr);
+    // one page is four data blocks and the inode, well
+    // within a single transaction.
+    begin_op();
+    ilock(ip);
+    if(off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      writei(ip, 0, PTE2PA(*pte), off, n);
+    }
+    iunlock(ip);
+    end_op();
+    *pte &= ~PTE_D;
+  }
+}
+
+// Unmap the pages of [va, va+len) of v that have been
+// faulted in.
+static void
+vmaunmap(pagetable_t pagetable, struct vma *v, uint64 va, uint64 len)
+{
+  uvmunmaplazy(pagetable, va, len / PGSIZE);
+  if(v->f && (v->flags & MAP_SHARED))
+    shdrop(v->f->ip);
+}
+
+// Create a mapping of len bytes. f is the file to map at
+// offset off, or 0 for MAP_ANONYMOUS. addr is a hint, used if
+// the range there is page-aligned and free. Returns the address
+// of the mapping, or -1.
+// The caller holds p->vmlock, as for munmap(), mmapfork()
+// and mmapexit().
+uint64
+mmap(uint64 addr, int len, int prot, int flags, struct file *f, int off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv;
+  uint64 a;
+
+  if(len <= 0 || off < 0 || (off % PGSIZE) != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(f == 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  } else {
+    f = 0;
+    off = 0;
+  }
+
+  nv = 0;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(!v->used){
+      nv = v;
+      break;
+    }
+  }
+  if(nv == 0)
+    return -1;
+
+  len = PGROUNDUP(len);
+  if((addr = vmaplace(p, addr, len)) == 0)
+    return -1;
+
+  nv->used = 1;
+  nv->addr = addr;
+  nv->len = len;
+  nv->prot = prot;
+  nv->flags = flags;
+  nv->f = f ? filedup(f) : 0;
+  nv->off = off;
+
+  // shared anonymous memory has no file to hold pages that
+  // are first touched after a fork(), so populate it now
+  // and let fork() share every page.
+  if((flags & (MAP_SHARED|MAP_ANONYMOUS)) == (MAP_SHARED|MAP_ANONYMOUS)){
+    for(a = addr; a < addr + len; a += PGSIZE){
+      if(vmapopulate(p, nv, a) == 0){
+        vmaunmap(p->pagetable, nv, addr, a - addr);
+        nv->used = 0;
+        return -1;
+      }
+    }
+  }
+
+  return addr;
+}
+
+// Remove the mappings of [addr, addr+len), which must lie
+// within a single region. Returns 0 on success, -1 on error.
+int
+munmap(uint64 addr, int len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv;
+  uint64 end;
+
+  if(len <= 0 || (addr % PGSIZE) != 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmalookup(p, addr)) == 0 || addr + len > v->addr + v->len)
+    return -1;
+  end = v->addr + v->len;
+
+  // punching a hole splits the region in two.
+  nv = 0;
+  if(addr > v->addr && addr + len < end){
+    for(nv = p->vmas; nv < &p->vmas[NVMA]; nv++)
+      if(!nv->used)
+        break;
+    if(nv == &p->vmas[NVMA])
+      return -1;
+  }
+
+  if(v->f)
+    vmawriteback(p, v, addr, len);
+  vmaunmap(p->pagetable, v, addr, len);
+
+  if(nv){
+    *nv = *v;
+    nv->addr = addr + len;
+    nv->len = end - nv->addr;
+    nv->off = v->off + (nv->addr - v->addr);
+    if(nv->f)
+      filedup(nv->f);
+    v->len = addr - v->addr;
+  } else if(addr == v->addr && len == v->len){
+    if(v->f)
+      fileclose(v->f);
+    v->used = 0;
+  } else if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+    v->len -= len;
+  } else {
+    v->len -= len;
+  }
+  return 0;
+}
+
+// Give child np the mappings of p, as part of fork().
+// MAP_SHARED regions end up referring to the same physical
+// pages, which are never megapages; MAP_PRIVATE regions get
+// copies of the pages touched so far. Returns 0 on success;
+// on failure undoes everything and returns -1.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+  uint64 a, pa;
+
+  for(v = p->vmas, nv = np->vmas; v < &p->vmas[NVMA]; v++, nv++){
+    if(!v->used)
+      continue;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    if((v->flags & MAP_SHARED) == 0){
+      if(uvmcopylazy(p->pagetable, np->pagetable, v->addr, v->addr + v->len) < 0)
+        goto err;
+      continue;
+    }
+    // fault in the rest of the region, so that parent
+    // and child see each other's stores.
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0){
+        if((pa = vmapopulate(p, v, a)) == 0)
+          goto err;
+      } else {
+        pa = PTE2PA(*pte);
+      }
+      if(mappages(np->pagetable, a, PGSIZE, pa, vmaperm(v)) != 0)
+        goto err;
+      kincref((void*)pa);
+    }
+  }
+  return 0;
+
+ err:
+  for(nv = np->vmas; nv < &np->vmas[NVMA]; nv++){
+    if(!nv->used)
+      continue;
+    vmaunmap(np->pagetable, nv, nv->addr, nv->len);
+    if(nv->f)
+      fileclose(nv->f);
+    nv->used = 0;
+  }
+  return -1;
+}
+
+// Remove all of p's mappings, writing back shared dirty pages.
+// Called by exit() and exec().
+void
+mmapexit(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(!v->used)
+      continue;
+    if(v->f)
+      vmawriteback(p, v, v->addr, v->len);
+    vmaunmap(p->pagetable, v, v->addr, v->len);
+    if(v->f)
+      fileclose(v->f);
+    v->used = 0;
+  }
+}
@@ -1,13 +1,19 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      4096  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mmap()ed regions per process
+#define NFILE      1000  // open files per system
+#define NINODE     1000  // maximum number of active i-nodes
+#define NTEXTPAGE   512  // pages in the shared text cache
+#define NTEXTINODE   32  // binaries in the shared text cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
+#define LOGSIZE      (MAXOPBLOCKS*3)  // default # of blocks in on-disk log
+#define MAXLOGSIZE   250  // max data blocks the log uses
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXCLUSTER   32  // max # of blocks in one disk request
+#define FSSIZE       2000  // size of file system in blocks
+#define SWAPSIZE     8192  // size of swap area in blocks, after the file system
 #define MAXPATH      128   // maximum file path name
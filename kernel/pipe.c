@@ -3,9 +3,9 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 
 #define PIPESIZE 512
@@ -19,6 +19,14 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+static struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +36,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +55,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,36 +76,54 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// copyin() and copyout() may sleep to swap a page in, so
+// user data goes through a buffer on the kernel stack, and
+// is copied without holding pi->lock. A read or write moves
+// one chunk at a time, but each wakes the other side only
+// once, when it is done or must wait.
+#define PIPECHUNK 128
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, j, m;
   struct proc *pr = myproc();
+  char buf[PIPECHUNK];
 
-  acquire(&pi->lock);
   while(i < n){
-    if(pi->readopen == 0 || pr->killed){
-      release(&pi->lock);
-      return -1;
+    m = n - i < PIPECHUNK ? n - i : PIPECHUNK;
+    if(copyin(pr->pagetable, buf, addr + i, m) == -1){
+      if(i > 0){
+        acquire(&pi->lock);
+        wakeup(&pi->nread);
+        release(&pi->lock);
+      }
+      break;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+    acquire(&pi->lock);
+    for(j = 0; j < m; ){
+      if(pi->readopen == 0 || pr->killed){
+        wakeup(&pi->nread);
+        release(&pi->lock);
+        return -1;
+      }
+      if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+        wakeup(&pi->nread);
+        sleep(&pi->nwrite, &pi->lock);
+      } else {
+        pi->data[pi->nwrite++ % PIPESIZE] = buf[j++];
+      }
     }
+    i += m;
+    if(i == n)
+      wakeup(&pi->nread);
+    release(&pi->lock);
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
 
   return i;
 }
@@ -105,9 +131,9 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i = 0, m, done;
   struct proc *pr = myproc();
-  char ch;
+  char buf[PIPECHUNK];
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -117,14 +143,28 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
-      break;
+  // copy out a chunk at a time until n bytes or the pipe is empty.
+  for(;;){
+    for(m = 0; m < PIPECHUNK && i + m < n; m++){  //DOC: piperead-copy
+      if(pi->nread == pi->nwrite)
+        break;
+      buf[m] = pi->data[pi->nread++ % PIPESIZE];
+    }
+    done = i + m == n || pi->nread == pi->nwrite;
+    if(done)
+      wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+    release(&pi->lock);
+    if(m > 0 && copyout(pr->pagetable, addr + i, buf, m) == -1){
+      if(!done){
+        acquire(&pi->lock);
+        wakeup(&pi->nwrite);
+        release(&pi->lock);
+      }
+      return -1;
+    }
+    i += m;
+    if(done)
+      return i;
+    acquire(&pi->lock);
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
-  release(&pi->lock);
-  return i;
 }
@@ -3,14 +3,44 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "ioprio.h"
 #include <limits.h>
 #include <math.h>
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Live processes, allocated from a slab cache and linked
+// through p->next and p->prev. A process is on the list from
+// allocproc() until its parent reaps it. ptable.lock must be
+// acquired after wait_lock and before any p->lock.
+struct {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+  int n;                // processes on the list
+  int max;              // limit on n, scaled to RAM
+} ptable;
+
+static struct kmem_cache *proccache;
+
+// Kernel stacks. A stack is allocated and mapped at KSTACK(slot)
+// the first time a slot is needed, with an unmapped guard page
+// below it, and stays mapped for reuse when its process is
+// freed, so the kernel page table only ever gains mappings.
+// gen counts the stacks mapped; each CPU flushes its TLB
+// before running a process if gen has moved on.
+struct {
+  struct spinlock lock;
+  int nslot;            // slots mapped so far
+  int nfree;
+  int free[NPROC];      // mapped slots not in use
+  int gen;
+} kstacks;
+
+extern pagetable_t kernel_pagetable;
 
 struct proc *initproc;
 
@@ -24,7 +54,9 @@ int queue_tail[5];             // current tail index for each of the queues
 int ageing_threshold[5];       // ageing threshold for each queue
 
 extern void forkret(void);
-static void freeproc(struct proc *p);
+static void kthreadstart(void);
+static pagetable_t freeproc(struct proc *p, uint64 *sz);
+static void procrelease(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -34,19 +66,50 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl) {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+// Return a kernel stack slot, mapping a new stack high in
+// memory if no mapped one is free.
+// Returns -1 if out of slots or memory.
+static int
+kstackalloc(void)
+{
+  int slot = -1;
+  char *pa;
+
+  acquire(&kstacks.lock);
+  if(kstacks.nfree > 0){
+    slot = kstacks.free[--kstacks.nfree];
+  } else if(kstacks.nslot < NPROC && (pa = kalloc()) != 0){
+    if(mappages(kernel_pagetable, KSTACK(kstacks.nslot), PGSIZE,
+                (uint64)pa, PTE_R | PTE_W) == 0){
+      slot = kstacks.nslot++;
+      __sync_synchronize();
+      kstacks.gen++;
+    } else {
+      kfree(pa);
+    }
+  }
+  release(&kstacks.lock);
+  return slot;
+}
+
+static void
+kstackfree(int slot)
+{
+  acquire(&kstacks.lock);
+  kstacks.free[kstacks.nfree++] = slot;
+  release(&kstacks.lock);
+}
+
+// Flush this CPU's TLB if kernel stacks have been mapped
+// since it last did, before it switches to a process
+// whose stack may be new. Interrupts must be off.
+static void
+kstackfence(struct cpu *c)
+{
+  __sync_synchronize();
+  if(c->kstackgen != kstacks.gen){
+    c->kstackgen = kstacks.gen;
+    sfence_vma();
   }
 }
 
@@ -54,13 +117,18 @@ proc_mapstacks(pagetable_t kpgtbl) {
 void
 procinit(void)
 {
-  struct proc *p;
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  initlock(&ptable.lock, "ptable");
+  initlock(&kstacks.lock, "kstacks");
+  proccache = kmem_cache_create("proc", sizeof(struct proc));
+
+  // one process per 256 KB of RAM, between 64 and NPROC.
+  ptable.max = (phystop - KERNBASE) / (256*1024);
+  if(ptable.max < 64)
+    ptable.max = 64;
+  if(ptable.max > NPROC)
+    ptable.max = NPROC;
 }
 
 // Must be called with interrupts disabled,
@@ -104,26 +172,47 @@ allocpid() {
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Allocate a proc and a kernel stack for it, and add it to
+// the process list. Initialize state required to run in the
+// kernel, and return with p->lock held.
+// If there are too many procs, or a memory allocation fails, return 0.
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
+  pagetable_t pt;
+  uint64 sz;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  acquire(&ptable.lock);
+  if(ptable.n == ptable.max){
+    release(&ptable.lock);
+    return 0;
   }
-  return 0;
+  ptable.n++;
+  release(&ptable.lock);
+
+  if((p = kmem_cache_alloc(proccache)) == 0)
+    goto bad;
+  memset(p, 0, sizeof(*p));
+  if((p->kslot = kstackalloc()) < 0){
+    kmem_cache_free(proccache, p);
+    goto bad;
+  }
+  initlock(&p->lock, "proc");
+  initsleeplock(&p->vmlock, "vm");
+  p->kstack = KSTACK(p->kslot);
+  p->state = USED;
+
+  acquire(&ptable.lock);
+  p->prev = ptable.tail;
+  if(ptable.tail)
+    ptable.tail->next = p;
+  else
+    ptable.head = p;
+  ptable.tail = p;
+  release(&ptable.lock);
 
-found:
+  acquire(&p->lock);
   p->pid = allocpid();
   // printf("alloced %d \n", p->pid);
   p->state = USED;
@@ -144,11 +233,16 @@ found:
 
   // Set the default value of the static priority to 60
   p->pstatic = 60;
+  p->ioclass = IOCLASS_BE;
+  p->logseq = 0;
+  p->logres = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
-    freeproc(p);
+    pt = freeproc(p, &sz);
     release(&p->lock);
+    procrelease(p);
+    reapqueue(pt, sz);
     return 0;
   }
 
@@ -161,8 +255,19 @@ found:
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
   if(p->pagetable == 0){
-    freeproc(p);
+    pt = freeproc(p, &sz);
+    release(&p->lock);
+    procrelease(p);
+    reapqueue(pt, sz);
+    return 0;
+  }
+
+  // A kernel page table to run on, that will map user memory too.
+  if((p->kpagetable = ukvmcreate()) == 0){
+    pt = freeproc(p, &sz);
     release(&p->lock);
+    procrelease(p);
+    reapqueue(pt, sz);
     return 0;
   }
 
@@ -175,20 +280,35 @@ found:
   // printf("PROCESS: %d %d\n",p->pid, p->ctime);
 
   return p;
+
+bad:
+  acquire(&ptable.lock);
+  ptable.n--;
+  release(&ptable.lock);
+  return 0;
 }
 
-// free a proc structure and the data hanging from it,
-// including user pages.
+// free a proc structure and the data hanging from it, except
+// for the user page table, which it returns, with the size of
+// user memory in *sz. the caller hands them to reapqueue()
+// once it holds no locks; p is still on the process list
+// until procrelease(), and reapqueue() may allocate and
+// calls wakeup(), which takes every p->lock.
 // p->lock must be held.
-static void
-freeproc(struct proc *p)
+static pagetable_t
+freeproc(struct proc *p, uint64 *sz)
 {
+  pagetable_t pagetable = p->pagetable;
+
+  *sz = p->sz;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+  if(p->kpagetable)
+    ukvmfree(p->kpagetable);
+  p->kpagetable = 0;
   p->pagetable = 0;
+  p->asid = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -197,6 +317,29 @@ freeproc(struct proc *p)
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+  return pagetable;
+}
+
+// Take p, which freeproc() has made UNUSED, off the process
+// list and free it, keeping its kernel stack for reuse.
+// p->lock must not be held.
+static void
+procrelease(struct proc *p)
+{
+  acquire(&ptable.lock);
+  if(p->prev)
+    p->prev->next = p->next;
+  else
+    ptable.head = p->next;
+  if(p->next)
+    p->next->prev = p->prev;
+  else
+    ptable.tail = p->prev;
+  ptable.n--;
+  release(&ptable.lock);
+
+  kstackfree(p->kslot);
+  kmem_cache_free(proccache, p);
 }
 
 // Create a user page table for a given process,
@@ -292,18 +435,57 @@ growproc(int n)
   uint sz;
   struct proc *p = myproc();
 
+  acquiresleep(&p->vmlock);
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > mmapbase(p) || sz + n < sz ||
+       (sz = uvmalloc(p->pagetable, sz, sz + n)) == 0){
+      releasesleep(&p->vmlock);
       return -1;
     }
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
+  ukvmsync(p);
+  releasesleep(&p->vmlock);
   return 0;
 }
 
+// Start a kernel thread: a process that runs fn in the
+// kernel and never goes to user space.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  p->state = RUNNABLE;
+  #ifdef MLFQ
+  p->cur_queue = 0;
+  push_to(p->cur_queue, p->pid);
+  p->mlfq_priority = 0;
+  #endif
+  release(&p->lock);
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
 int
@@ -312,19 +494,42 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
+  pagetable_t pt;
+  uint64 sz;
 
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Copy user memory and mmap()ed regions from parent to
+  // child. This may read files or swap pages in and out,
+  // so it cannot hold np->lock, but must keep the swap
+  // reclaimer away from the parent.
+  release(&np->lock);
+  acquiresleep(&p->vmlock);
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
-    freeproc(np);
+    releasesleep(&p->vmlock);
+    acquire(&np->lock);
+    pt = freeproc(np, &sz);
     release(&np->lock);
+    procrelease(np);
+    reapqueue(pt, sz);
     return -1;
   }
   np->sz = p->sz;
+  if(mmapfork(p, np) < 0){
+    releasesleep(&p->vmlock);
+    acquire(&np->lock);
+    pt = freeproc(np, &sz);
+    release(&np->lock);
+    procrelease(np);
+    reapqueue(pt, sz);
+    return -1;
+  }
+  ukvmsync(np);
+  releasesleep(&p->vmlock);
+  acquire(&np->lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -335,6 +540,10 @@ fork(void)
   // copy trace mask from parent to child
   np->mask = p->mask;
 
+  // page merging carries over too.
+  np->ksm = p->ksm;
+  np->ioclass = p->ioclass;
+
   // increment reference counts on open file descriptors.
   for(i = 0; i < NOFILE; i++)
     if(p->ofile[i])
@@ -369,13 +578,18 @@ void
 reparent(struct proc *p)
 {
   struct proc *pp;
+  int found = 0;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  acquire(&ptable.lock);
+  for(pp = ptable.head; pp; pp = pp->next){
     if(pp->parent == p){
       pp->parent = initproc;
-      wakeup(initproc);
+      found = 1;
     }
   }
+  release(&ptable.lock);
+  if(found)
+    wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -389,6 +603,11 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Keep the swap reclaimer away for good, and unmap
+  // mmap()ed regions, writing back dirty shared pages.
+  acquiresleep(&p->vmlock);
+  mmapexit(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -436,15 +655,18 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
+  pagetable_t pt;
+  uint64 sz;
 
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
+    acquire(&ptable.lock);
+    for(np = ptable.head; np; np = np->next){
       if(np->parent == p){
         // make sure the child isn't still in exit() or swtch().
         acquire(&np->lock);
@@ -452,21 +674,24 @@ wait(uint64 addr)
         havekids = 1;
         if(np->state == ZOMBIE){
           // Found one.
+          release(&ptable.lock);
           pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
+          xstate = np->xstate;
+          pt = freeproc(np, &sz);
           release(&np->lock);
+          procrelease(np);
           release(&wait_lock);
+          reapqueue(pt, sz);
+          // copyout() may sleep, so no spinlocks.
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&np->lock);
       }
     }
+    release(&ptable.lock);
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
@@ -486,15 +711,18 @@ int
 waitx(uint64 addr, uint *wtime, uint *rtime)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
+  pagetable_t pt;
+  uint64 sz;
 
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
+    acquire(&ptable.lock);
+    for(np = ptable.head; np; np = np->next){
       if(np->parent == p){
         // make sure the child isn't still in exit() or swtch().
         acquire(&np->lock);
@@ -502,24 +730,25 @@ waitx(uint64 addr, uint *wtime, uint *rtime)
         havekids = 1;
         if(np->state == ZOMBIE){
           // Found one.
+          release(&ptable.lock);
           pid = np->pid;
           *rtime = np->rtime;
           *wtime = np->etime - np->ctime - np->rtime;
-          if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                   sizeof(np->xstate)) < 0)
-          {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
+          xstate = np->xstate;
+          pt = freeproc(np, &sz);
           release(&np->lock);
+          procrelease(np);
           release(&wait_lock);
+          reapqueue(pt, sz);
+          if (addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                   sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&np->lock);
       }
     }
+    release(&ptable.lock);
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
@@ -538,7 +767,8 @@ void
 updatetime(void)
 {
   struct proc *p;
-  for (p = proc; p < &proc[NPROC]; p++)
+  acquire(&ptable.lock);
+  for (p = ptable.head; p; p = p->next)
   {
     acquire(&p->lock);
     if (p->mlfq_priority != -1)
@@ -574,6 +804,7 @@ updatetime(void)
     }
     release(&p->lock);
   }
+  release(&ptable.lock);
 }
 
 // Set priority of process
@@ -582,7 +813,8 @@ setpriority(uint pid, uint priority)
 {
   struct proc *p;
   int prev_priority = -1;
-  for (p = proc; p < &proc[NPROC]; p++)
+  acquire(&ptable.lock);
+  for (p = ptable.head; p; p = p->next)
   {
     acquire(&p->lock);
     if (p->pid == pid)
@@ -596,6 +828,7 @@ setpriority(uint pid, uint priority)
     }
     release(&p->lock);
   }
+  release(&ptable.lock);
   return prev_priority;
 }
 
@@ -604,18 +837,23 @@ void
 calc_dpriority(int pid, int prev_priority)
 {
   struct proc *p;
-  for (p = proc; p < &proc[NPROC]; p++)
+  int resched = 0;
+  acquire(&ptable.lock);
+  for (p = ptable.head; p; p = p->next)
   {
     acquire(&p->lock);
      if (p->pid == pid && prev_priority > p->pdynamic)
      {
        // printf("scheding to reschedule process with pid: %d \n", p->pid);
+       resched = 1;
        release(&p->lock);
-       yield();
        break;
      }
     release(&p->lock);
   }
+  release(&ptable.lock);
+  if (resched)
+    yield();
 }
 
 /*
@@ -754,7 +992,8 @@ scheduler(void)
       // switch context with that process
       // handle trap 
       struct proc *minp = NULL;
-      for (p = proc; p < &proc[NPROC]; p++)
+      acquire(&ptable.lock);
+      for (p = ptable.head; p; p = p->next)
       {
         acquire(&p->lock);
         if (p->state == RUNNABLE)
@@ -774,26 +1013,52 @@ scheduler(void)
         }
         release(&p->lock);
       }
+      // lock minp before it can be freed.
+      if (minp != NULL)
+        acquire(&minp->lock);
+      release(&ptable.lock);
     #endif
     #ifdef RR
       struct proc *p;
       // printf("RR chosen \n");
-      for(p = proc; p < &proc[NPROC]; p++) 
+      // run the first runnable process, and move it to
+      // the back of the list.
+      acquire(&ptable.lock);
+      for(p = ptable.head; p; p = p->next) 
       {
         acquire(&p->lock);
-        if(p->state == RUNNABLE) 
-        {
-          // Switch to chosen process.  It is the process's job
-          // to release its lock and then reacquire it
-          // before jumping back to us.
-          p->state = RUNNING;
-          c->proc = p;
-          swtch(&c->context, &p->context);
-
-          // Process is done running for now.
-          // It should have changed its p->state before coming back.
-          c->proc = 0;
-        }
+        if(p->state == RUNNABLE)
+          break;
+        release(&p->lock);
+      }
+      if(p && p->next)
+      {
+        if(p->prev)
+          p->prev->next = p->next;
+        else
+          ptable.head = p->next;
+        p->next->prev = p->prev;
+        p->prev = ptable.tail;
+        p->next = 0;
+        ptable.tail->next = p;
+        ptable.tail = p;
+      }
+      release(&ptable.lock);
+      if(p) 
+      {
+        // Switch to chosen process.  It is the process's job
+        // to release its lock and then reacquire it
+        // before jumping back to us.
+        p->state = RUNNING;
+        c->proc = p;
+        kstackfence(c);
+        kvmswitch(p);
+        swtch(&c->context, &p->context);
+        kvmswitch(0);
+
+        // Process is done running for now.
+        // It should have changed its p->state before coming back.
+        c->proc = 0;
         release(&p->lock);
       }
     #endif
@@ -801,7 +1066,8 @@ scheduler(void)
       struct proc *p;
       // calculate the niceness
       struct proc *minp = NULL;
-      for (p = proc; p < &proc[NPROC]; p++)
+      acquire(&ptable.lock);
+      for (p = ptable.head; p; p = p->next)
       {
         acquire(&p->lock);
         if (p->is_new == 1)
@@ -853,6 +1119,10 @@ scheduler(void)
         }
         release(&p->lock);
       }
+      // lock minp before it can be freed.
+      if (minp != NULL)
+        acquire(&minp->lock);
+      release(&ptable.lock);
     #endif
     #ifdef MLFQ
       struct proc *p;
@@ -870,7 +1140,8 @@ scheduler(void)
       {
         continue;
       }
-      for (p = proc; p < &proc[NPROC]; p++)
+      acquire(&ptable.lock);
+      for (p = ptable.head; p; p = p->next)
       {
         acquire(&p->lock);
         if (p->pid == chosen_pid)
@@ -879,6 +1150,10 @@ scheduler(void)
         }
         release(&p->lock);
       }
+      // lock minp before it can be freed.
+      if (minp != 0)
+        acquire(&minp->lock);
+      release(&ptable.lock);
       if (minp != 0 && minp->pid > 0 && minp->state == RUNNABLE)
       {
         /*
@@ -901,7 +1176,6 @@ scheduler(void)
         c->proc = 0;
         release(&minp->lock);
         */
-        acquire(&minp->lock);
         if (minp->state == RUNNABLE && minp->pid >= 0)
         {
           // printf("\n process executing: %d, level: %d \n", minp->pid, minp->cur_queue);
@@ -914,17 +1188,20 @@ scheduler(void)
           // printf("------chosen------- %d \n", minp->pid);
           // printf("tail size: %d \n", queue_tail[minp->cur_queue]);
           // printf("MLFQ running %d \n", minp->pid);
+          kstackfence(c);
+          kvmswitch(minp);
           swtch(&c->context, &minp->context);
+          kvmswitch(0);
           c->proc = 0;
         }
-        release(&minp->lock);
       }
+      if (minp != 0)
+        release(&minp->lock);
     #endif
     #if defined(FCFS) || defined(PBS)
       if (minp != NULL)
       {
         // printf("chosen: %d %d \n", minp->pid, minp->state==RUNNABLE);
-        acquire(&minp->lock);
         if (minp->state == RUNNABLE)
         {
           // printf("\n process executing: %d, level: %d \n", minp->pid, minp->cur_queue);
@@ -945,7 +1222,10 @@ scheduler(void)
           // printf("------chosen------- %d \n", minp->pid);
           // printf("tail size: %d \n", queue_tail[minp->cur_queue]);
           // printf("MLFQ running %d \n", minp->pid);
+          kstackfence(c);
+          kvmswitch(minp);
           swtch(&c->context, &minp->context);
+          kvmswitch(0);
           c->proc = 0;
         }
         release(&minp->lock);
@@ -1055,7 +1335,8 @@ wakeup(void *chan)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&ptable.lock);
+  for(p = ptable.head; p; p = p->next) {
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) 
@@ -1069,6 +1350,7 @@ wakeup(void *chan)
       release(&p->lock);
     }
   }
+  release(&ptable.lock);
 }
 
 // Kill the process with the given pid.
@@ -1079,7 +1361,8 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  acquire(&ptable.lock);
+  for(p = ptable.head; p; p = p->next){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
@@ -1092,14 +1375,65 @@ kill(int pid)
         #endif
       }
       release(&p->lock);
+      release(&ptable.lock);
       return 0;
     }
     printf("killed \n");
     release(&p->lock);
   }
+  release(&ptable.lock);
   return -1;
 }
 
+// Choose the next process whose memory the swap reclaimer or
+// the page merger should look at, going round the processes
+// by pid from *lastpid so that each gets its turn. Only
+// processes that are not running and have user memory
+// qualify, and if mergeable, only those that asked for
+// ksm(). Returns the process with p->vmlock and p->lock held,
+// or 0 if the one chosen is busy.
+struct proc*
+scanvictim(int *lastpid, int mergeable)
+{
+  struct proc *p, *next, *first;
+
+  next = first = 0;
+  acquire(&ptable.lock);
+  for(p = ptable.head; p; p = p->next){
+    if(p == myproc())
+      continue;
+    acquire(&p->lock);
+    if((p->state == SLEEPING || p->state == RUNNABLE) && p->sz > 0 &&
+       (!mergeable || p->ksm)){
+      if(p->pid > *lastpid && (next == 0 || p->pid < next->pid))
+        next = p;
+      if(first == 0 || p->pid < first->pid)
+        first = p;
+    }
+    release(&p->lock);
+  }
+  if(next == 0)
+    next = first;
+  if(next == 0){
+    release(&ptable.lock);
+    return 0;
+  }
+  *lastpid = next->pid;
+  p = next;
+  if(!tryacquiresleep(&p->vmlock)){
+    release(&ptable.lock);
+    return 0;
+  }
+  acquire(&p->lock);
+  release(&ptable.lock);
+  if(p->state != SLEEPING && p->state != RUNNABLE){
+    release(&p->lock);
+    releasesleep(&p->vmlock);
+    return 0;
+  }
+  return p;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
@@ -1168,7 +1502,7 @@ procdump(void)
     char *row[11] = {"PID", "PRIORITY", "STATE", "rtime", "wtime", "nrun", "q0", "q1", "q2", "q3", "q4"};
     printf("%s \t| %s \t| %s \t| %s \t| %s \t| %s \t\t|%s \t\t|%s \t\t|%s \t\t|%s \t\t|%s \t\t\n", row[0], row[1], row[2], row[3], row[4], row[5], row[6], row[7], row[8], row[9], row[10]);
   #endif
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = ptable.head; p; p = p->next){
     if (p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
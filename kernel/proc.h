@@ -24,6 +24,8 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this TLB was flushed for.
+  int kstackgen;              // Kernel stacks this TLB has seen mapped.
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +82,18 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of the address space created by mmap().
+// Pages are faulted in on first touch by mmapfault().
+struct vma {
+  int used;
+  uint64 addr;                 // First address, page-aligned
+  uint64 len;                  // Length, a multiple of PGSIZE
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, maybe MAP_ANONYMOUS
+  struct file *f;              // Backing file, or 0 if anonymous
+  uint off;                    // File offset of addr
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -96,15 +110,34 @@ struct proc {
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // ptable.lock must be held when using these:
+  struct proc *next;           // List of live processes
+  struct proc *prev;
+
+  // p->vmlock must be held when changing the user page table
+  // or copying to or from user memory, and when using swaphand.
+  struct sleeplock vmlock;
+  uint64 swaphand;             // Next address the swap clock looks at
+  uint64 ksmhand;              // Next address the page merger looks at
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
+  int kslot;                   // Kernel stack slot; see KSTACK()
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, with user memory below UKVMTOP
+  uint64 asid;                 // ASID and its generation, or 0
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vmas[NVMA];       // mmap()ed regions
   char name[16];               // Process name (debugging)
+  int ksm;                     // Let ksmd merge identical pages
+  int ioclass;                 // IOCLASS_ of its disk requests
+  uint logseq;                 // Last log transaction it wrote to
+  int logres;                  // Log blocks its FS sys call reserved
+  void (*kfn)(void);           // Body of a kernel thread, or 0
   int mask;                    // mask for trace
   uint ctime;                  // process creation time
   uint rtime;                  // how long did the proc run for
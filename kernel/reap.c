@@ -0,0 +1,103 @@
+// Address-space teardown in the background.
+//
+// wait() does not free a zombie child's user memory and page
+// tables itself: it queues them for the reaper kernel
+// threads, so that wait() returns as soon as the exit status
+// is known, however big the child was. The reapers run on
+// whichever harts are idle. An allocation that finds memory
+// short frees a queued address space itself rather than wait
+// for them; see ualloc().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NREAPER 2   // reaper threads
+
+struct reapjob {
+  pagetable_t pagetable;
+  uint64 sz;
+  struct reapjob *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct reapjob *head;
+  struct reapjob *tail;
+  struct kmem_cache *cache;
+} reaper;
+
+// Free the user page table pagetable, with sz bytes of user
+// memory, later. Frees it now if there is no memory to queue it.
+// pagetable may be 0. The caller must hold no spinlocks.
+void
+reapqueue(pagetable_t pagetable, uint64 sz)
+{
+  struct reapjob *j;
+
+  if(pagetable == 0)
+    return;
+  if((j = kmem_cache_alloc(reaper.cache)) == 0){
+    proc_freepagetable(pagetable, sz);
+    return;
+  }
+  j->pagetable = pagetable;
+  j->sz = sz;
+  j->next = 0;
+  acquire(&reaper.lock);
+  if(reaper.tail)
+    reaper.tail->next = j;
+  else
+    reaper.head = j;
+  reaper.tail = j;
+  wakeup(&reaper);
+  release(&reaper.lock);
+}
+
+// Free one queued address space.
+// Returns 1, or 0 if there was none.
+int
+reap(void)
+{
+  struct reapjob *j;
+
+  acquire(&reaper.lock);
+  if((j = reaper.head) != 0){
+    reaper.head = j->next;
+    if(reaper.head == 0)
+      reaper.tail = 0;
+  }
+  release(&reaper.lock);
+  if(j == 0)
+    return 0;
+  proc_freepagetable(j->pagetable, j->sz);
+  kmem_cache_free(reaper.cache, j);
+  return 1;
+}
+
+// The body of the reaper kernel threads.
+static void
+reaperd(void)
+{
+  for(;;){
+    acquire(&reaper.lock);
+    while(reaper.head == 0)
+      sleep(&reaper, &reaper.lock);
+    release(&reaper.lock);
+    reap();
+  }
+}
+
+void
+reapinit(void)
+{
+  initlock(&reaper.lock, "reaper");
+  reaper.cache = kmem_cache_create("reap", sizeof(struct reapjob));
+  for(int i = 0; i < NREAPER; i++)
+    kthread("reaper", reaperd);
+}
@@ -0,0 +1,347 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of one size, carved out of
+// kalloc() pages ("slabs"). Each slab starts with a header
+// that links it into its cache and keeps a free list of the
+// slab's objects, so an object finds its slab by rounding
+// its address down to a page boundary.
+//
+// Each CPU keeps a small magazine of free objects per cache,
+// so most allocations and frees only touch that CPU's
+// magazine. The cache lock is taken to refill an empty
+// magazine or to flush a full one.
+//
+// kmalloc() serves other sizes from power-of-two caches,
+// and whole pages for anything over half a page.
+//
+// Interface:
+// * kmem_cache_create(name, size) makes a cache.
+// * kmem_cache_alloc(c) and kmem_cache_free(c, obj).
+// * kmalloc(n) and kmfree(p).
+// * slabreclaim() returns unused slabs to kalloc().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define NCACHE   32   // caches in the system
+#define MAGSIZE  16   // objects in a per-CPU magazine
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 1024
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;    // partial list of the cache
+  struct slab *prev;
+  void *free;           // free objects, linked through their first word
+  int inuse;            // objects handed out, including to magazines
+  int pad;
+};
+
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;            // object size, a multiple of 8
+  int perslab;          // objects in a slab
+  struct slab *partial; // slabs with free objects
+  int nslab;            // slabs allocated
+  int nempty;           // slabs on partial with no objects in use
+  struct magazine mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} slabs;
+
+// size classes for kmalloc().
+static struct kmem_cache *kmcache[7];
+static char *kmnames[] = { "kmalloc-16", "kmalloc-32", "kmalloc-64",
+                           "kmalloc-128", "kmalloc-256", "kmalloc-512",
+                           "kmalloc-1024" };
+
+void
+slabinit(void)
+{
+  int i, size;
+
+  initlock(&slabs.lock, "slabs");
+  for(i = 0, size = KMALLOC_MIN; size <= KMALLOC_MAX; i++, size *= 2)
+    kmcache[i] = kmem_cache_create(kmnames[i], size);
+}
+
+// Make a cache of objects of the given size.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size > PGSIZE - sizeof(struct slab))
+    panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  if(slabs.n == NCACHE)
+    panic("kmem_cache_create: too many");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, "magazine");
+  return c;
+}
+
+// Unlink s from c's partial list.
+// Caller must hold c->lock.
+static void
+slabunlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Add s to the front of c's partial list.
+// Caller must hold c->lock.
+static void
+slablink(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Move up to n objects from c's slabs into m.
+// Caller must hold m->lock and c->lock.
+static void
+refill(struct kmem_cache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+
+  while(m->n < n && (s = c->partial) != 0){
+    if(s->inuse == 0)
+      c->nempty--;
+    while(m->n < n && s->free){
+      m->obj[m->n++] = s->free;
+      s->free = *(void**)s->free;
+      s->inuse++;
+    }
+    if(s->free == 0)
+      slabunlink(c, s);
+  }
+}
+
+// Return the top n objects of m to their slabs. Empty slabs
+// beyond the first are handed back to kalloc().
+// Returns the number of pages freed.
+// Caller must hold m->lock and c->lock.
+static int
+flush(struct kmem_cache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+  void *obj;
+  int freed = 0;
+
+  while(n-- > 0 && m->n > 0){
+    obj = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)obj);
+    if(s->free == 0)
+      slablink(c, s);
+    *(void**)obj = s->free;
+    s->free = obj;
+    if(--s->inuse == 0){
+      if(c->nempty > 0){
+        slabunlink(c, s);
+        c->nslab--;
+        kfree(s);
+        freed++;
+      } else {
+        c->nempty++;
+      }
+    }
+  }
+  return freed;
+}
+
+// Add a new slab to c. Returns 0 if out of memory.
+// Must not be called with any slab lock held, since
+// kalloc() may call slabreclaim().
+static int
+grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *p;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  p = (char*)s + PGSIZE - c->perslab * c->size;
+  for(int i = 0; i < c->perslab; i++, p += c->size){
+    *(void**)p = s->free;
+    s->free = p;
+  }
+
+  acquire(&c->lock);
+  slablink(c, s);
+  c->nslab++;
+  c->nempty++;
+  release(&c->lock);
+  return 1;
+}
+
+// Allocate an object from c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  for(;;){
+    push_off();
+    m = &c->mag[cpuid()];
+    acquire(&m->lock);
+    if(m->n == 0){
+      acquire(&c->lock);
+      refill(c, m, MAGSIZE / 2);
+      release(&c->lock);
+    }
+    obj = m->n > 0 ? m->obj[--m->n] : 0;
+    release(&m->lock);
+    pop_off();
+
+    if(obj)
+      return obj;
+    if(grow(c) == 0)
+      return 0;
+  }
+}
+
+// Free an object allocated from c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  if(((struct slab*)PGROUNDDOWN((uint64)obj))->cache != c)
+    panic("kmem_cache_free");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    flush(c, m, MAGSIZE / 2);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+}
+
+// Allocate n bytes of kernel memory.
+// Returns 0 if out of memory.
+void*
+kmalloc(uint n)
+{
+  int i, size;
+
+  if(n > KMALLOC_MAX){
+    if(n > PGSIZE)
+      panic("kmalloc");
+    return kalloc();
+  }
+  for(i = 0, size = KMALLOC_MIN; size < n; i++, size *= 2)
+    ;
+  return kmem_cache_alloc(kmcache[i]);
+}
+
+// Free memory returned by kmalloc(). Slab objects never
+// start on a page boundary, since the slab header does.
+void
+kmfree(void *p)
+{
+  if(((uint64)p % PGSIZE) == 0)
+    kfree(p);
+  else
+    kmem_cache_free(((struct slab*)PGROUNDDOWN((uint64)p))->cache, p);
+}
+
+// Drain every CPU's magazines and free all empty slabs.
+// Called by kalloc() when memory runs out.
+// Returns the number of pages freed.
+int
+slabreclaim(void)
+{
+  struct kmem_cache *c;
+  struct slab *s, *next;
+  int i, n, freed = 0;
+
+  acquire(&slabs.lock);
+  n = slabs.n;
+  release(&slabs.lock);
+
+  for(c = slabs.cache; c < &slabs.cache[n]; c++){
+    for(i = 0; i < NCPU; i++){
+      acquire(&c->mag[i].lock);
+      acquire(&c->lock);
+      freed += flush(c, &c->mag[i], MAGSIZE);
+      release(&c->lock);
+      release(&c->mag[i].lock);
+    }
+    acquire(&c->lock);
+    for(s = c->partial; s; s = next){
+      next = s->next;
+      if(s->inuse == 0){
+        slabunlink(c, s);
+        c->nslab--;
+        c->nempty--;
+        kfree(s);
+        freed++;
+      }
+    }
+    release(&c->lock);
+  }
+  return freed;
+}
+
+// Report pages held by slabs.
+void
+slabstat(struct memstat *st)
+{
+  struct kmem_cache *c;
+  int n;
+
+  acquire(&slabs.lock);
+  n = slabs.n;
+  release(&slabs.lock);
+
+  st->slabpages = 0;
+  for(c = slabs.cache; c < &slabs.cache[n]; c++){
+    acquire(&c->lock);
+    st->slabpages += c->nslab;
+    release(&c->lock);
+  }
+}
@@ -16,10 +16,15 @@ uint64 timer_scratch[NCPU][5];
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
-// entry.S jumps here in machine mode on stack0.
+// entry.S jumps here in machine mode on stack0,
+// with the physical address of the device tree.
 void
-start()
+start(uint64 hartid, uint64 fdt)
 {
+  // remember the device tree for kinit().
+  if(hartid == 0)
+    fdtpa = fdt;
+
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
@@ -0,0 +1,302 @@
+// Swap space: user pages written out to the part of the disk
+// that mkfs reserves after the file system (see fs.h), or
+// kept compressed in memory by zram.c.
+//
+// When kalloc() runs dry, ualloc() takes pages from other
+// processes with a clock (second-chance) scan of their memory.
+// A page whose PTE_A bit is set just has it cleared; a page
+// that has not been touched since the last pass goes to a
+// swap slot, and its PTE becomes a non-valid PTE_SWAP entry
+// holding the slot. The next access faults, and vmfault()
+// reads the page back with swapin().
+//
+// A slot below swap.nslot is a page of the swap area; a
+// ZRAMSLOT() is the address of a compressed page instead.
+//
+// A process's p->vmlock keeps the reclaimer out of its page
+// table while the process is changing the table or copying
+// to or from its memory.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "memstat.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)    // disk blocks per swap slot
+#define NSLOT      (SWAPSIZE / SLOTBLOCKS)
+#define SWAPBATCH  16    // pages written out per victim
+#define SWAPSCAN   4096  // PTEs looked at per victim
+#define SWAPTRY    8     // victims tried per allocation
+
+#define ZRAMSLOT(slot) ((slot) >= KERNBASE)
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;           // first block of the swap area
+  int nslot;            // usable slots
+  int nused;
+  int hint;             // where to look for a free slot
+  uchar ref[NSLOT];     // page tables that refer to each slot
+  uint64 nin;           // pages read back in
+  uint64 nout;          // pages written out
+} swap;
+
+// swap I/O goes through private buffers, not the buffer
+// cache: swapped pages are not file system blocks.
+struct {
+  struct sleeplock lock;
+  struct buf buf[SLOTBLOCKS];
+} swapio;
+
+// Called by fsinit() once the superblock has been read.
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swapio.lock, "swapio");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / SLOTBLOCKS;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+}
+
+// Allocate a swap slot. Returns -1 if swap is full.
+static int
+slotalloc(void)
+{
+  int i, s;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot; i++){
+    s = (swap.hint + i) % swap.nslot;
+    if(swap.ref[s] == 0){
+      swap.ref[s] = 1;
+      swap.nused++;
+      swap.hint = s + 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Another page table (a fork()ed child's) now refers to slot.
+void
+swapdup(uint64 slot)
+{
+  if(ZRAMSLOT(slot)){
+    zramdup(slot);
+    return;
+  }
+  acquire(&swap.lock);
+  if(slot >= swap.nslot || swap.ref[slot] == 0 || swap.ref[slot] == 255)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot.
+void
+swapfree(uint64 slot)
+{
+  if(ZRAMSLOT(slot)){
+    zramfree(slot);
+    return;
+  }
+  acquire(&swap.lock);
+  if(slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapfree");
+  if(--swap.ref[slot] == 0)
+    swap.nused--;
+  release(&swap.lock);
+}
+
+// Read or write the page at pa from or to slot,
+// with the disk working on all of its blocks at once.
+static void
+swaprw(uint64 slot, char *pa, int write)
+{
+  struct buf *b;
+  int i;
+
+  acquiresleep(&swapio.lock);
+  for(i = 0; i < SLOTBLOCKS; i++){
+    b = &swapio.buf[i];
+    b->dev = swap.dev;
+    b->blockno = swap.start + slot*SLOTBLOCKS + i;
+    if(write)
+      memmove(b->data, pa + i*BSIZE, BSIZE);
+    iosubmit(b, write, 1);
+  }
+  for(i = 0; i < SLOTBLOCKS; i++){
+    b = &swapio.buf[i];
+    iowait(b);
+    if(!write)
+      memmove(pa + i*BSIZE, b->data, BSIZE);
+  }
+  releasesleep(&swapio.lock);
+}
+
+// Bring back the page that the PTE_SWAP PTE pte refers to.
+// The caller holds the vmlock of the page table's process.
+// Returns 0, or -1 if there is no memory for it.
+int
+swapin(pte_t *pte)
+{
+  uint64 slot = PTE2SLOT(*pte);
+  char *mem;
+
+  if((mem = ualloc()) == 0)
+    return -1;
+  if(ZRAMSLOT(slot))
+    zramload(slot, mem);
+  else
+    swaprw(slot, mem, 0);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V | PTE_A;
+  swapfree(slot);
+  acquire(&swap.lock);
+  swap.nin++;
+  release(&swap.lock);
+  return 0;
+}
+
+// Pick up to SWAPBATCH pages of p to evict, going on from
+// where the clock hand stopped last time, and make their PTEs
+// non-valid PTE_SWAP ones that still hold the physical
+// address; swapout() puts the slot there once the page has
+// been stored. Only private 4096-byte pages of p's heap and
+// stack are candidates. The caller holds p->vmlock, and that
+// alone keeps p out of its page table: swapout() releases
+// p->lock before storing the pages, so p may run, but a fault
+// on one of them blocks in vmfault() until vmlock is released.
+static int
+pageselect(struct proc *p, uint64 *va)
+{
+  int i, n, level, changed;
+  uint64 a;
+  pte_t *pte;
+
+  n = changed = 0;
+  for(i = 0; i < SWAPSCAN && n < SWAPBATCH && p->sz > 0; i++){
+    a = p->swaphand < p->sz ? p->swaphand : 0;
+    p->swaphand = a + PGSIZE < p->sz ? a + PGSIZE : 0;
+    pte = walklevel(p->pagetable, a, 0, &level);
+    if(pte == 0 || level != 0 ||
+       (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W) ||
+       krefcnt((void*)PTE2PA(*pte)) != 1)
+      continue;
+    changed = 1;
+    if(*pte & PTE_A){
+      // used since the hand last passed: a second chance.
+      *pte &= ~PTE_A;
+      continue;
+    }
+    va[n++] = a;
+    *pte = (*pte & ~(PTE_V|PTE_A|PTE_D)) | PTE_SWAP;
+  }
+  if(changed)
+    asidretire(p);
+  return n;
+}
+
+// Store the page that pte, made PTE_SWAP by pageselect(),
+// still refers to: compressed if it compresses well, else on
+// disk. Returns 0, or -1 if there is no room, in which case
+// the page is mapped again.
+static int
+pagestore(pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte) & (PTE_R|PTE_W|PTE_X|PTE_U);
+  uint64 slot;
+  int s;
+
+  if((slot = zramstore((void*)pa)) == 0){
+    if((s = slotalloc()) < 0){
+      *pte = PA2PTE(pa) | flags | PTE_V;
+      return -1;
+    }
+    slot = s;
+    swaprw(slot, (char*)pa, 1);
+  }
+  *pte = SLOT2PTE(slot) | flags | PTE_SWAP;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Evict some pages of another process.
+// Returns the number of pages freed.
+static int
+swapout(void)
+{
+  static int lastpid;
+  struct proc *p;
+  uint64 va[SWAPBATCH];
+  int i, j, n, freed;
+
+  for(i = 0; i < SWAPTRY; i++){
+    if(swap.nused == swap.nslot && zramfull())
+      break;
+    if((p = scanvictim(&lastpid, 0)) == 0)
+      continue;
+    n = pageselect(p, va);
+    release(&p->lock);
+    freed = 0;
+    for(j = 0; j < n; j++)
+      if(pagestore(walk(p->pagetable, va[j], 0)) == 0)
+        freed++;
+    releasesleep(&p->vmlock);
+    if(freed > 0){
+      acquire(&swap.lock);
+      swap.nout += freed;
+      release(&swap.lock);
+      return freed;
+    }
+  }
+  return 0;
+}
+
+// Allocate a page for user memory, writing out pages of other
+// processes if memory is short. May sleep, so the caller must
+// not hold a spinlock. Returns 0 if memory and swap are full.
+void *
+ualloc(void)
+{
+  void *mem;
+
+  for(int i = 0; i < SWAPTRY; i++){
+    if((mem = kalloc()) != 0)
+      return mem;
+    // memory of exited processes that the reapers
+    // have not freed yet comes first.
+    if(reap()){
+      i--;
+      continue;
+    }
+    if(swapout() == 0)
+      break;
+  }
+  return 0;
+}
+
+// Report swap usage and traffic.
+void
+swapstat(struct memstat *st)
+{
+  acquire(&swap.lock);
+  st->swapslots = swap.nslot;
+  st->swapused = swap.nused;
+  st->swapins = swap.nin;
+  st->swapouts = swap.nout;
+  release(&swap.lock);
+}
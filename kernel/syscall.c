@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
@@ -107,6 +108,13 @@ extern uint64 sys_uptime(void);
 extern uint64 sys_strace(void);
 extern uint64 sys_waitx(void);
 extern uint64 sys_setpriority(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_ksm(void);
+extern uint64 sys_bcachestat(void);
+extern uint64 sys_fadvise(void);
+extern uint64 sys_ionice(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]        sys_fork,
@@ -133,13 +141,21 @@ static uint64 (*syscalls[])(void) = {
 [SYS_strace]      sys_strace,
 [SYS_waitx]       sys_waitx,
 [SYS_setpriority] sys_setpriority,
+[SYS_mmap]        sys_mmap,
+[SYS_munmap]      sys_munmap,
+[SYS_memstat]     sys_memstat,
+[SYS_ksm]         sys_ksm,
+[SYS_bcachestat]  sys_bcachestat,
+[SYS_fadvise]     sys_fadvise,
+[SYS_ionice]      sys_ionice,
 };
 
 char *syscallnames[NELEM(syscalls)] = {"fork", "exit", "wait", "pipe", "read", "kill", "exec", "fstat", "chdir", "dup",
                       "getpid", "sbrk", "sleep", "uptime", "open", "write", "mknod", "unlink", "link",
-                      "mkdir", "close", "strace", "waitx", "setpriority"};
+                      "mkdir", "close", "strace", "waitx", "setpriority",
+                      "mmap", "munmap", "memstat", "ksm", "bcachestat", "fadvise", "ionice"};
 
-int argscnt[NELEM(syscalls)] = {0, 0, 1, 1, 3, 1, 2, 2, 1, 1, 0, 1, 1, 0, 2, 3, 3, 1, 2, 1, 1, 1, 3, 2};
+int argscnt[NELEM(syscalls)] = {0, 0, 1, 1, 3, 1, 2, 2, 1, 1, 0, 1, 1, 0, 2, 3, 3, 1, 2, 1, 1, 1, 3, 2, 6, 2, 1, 1, 1, 4, 1};
 
 void syscall(void)
 {
@@ -23,3 +23,10 @@
 #define SYS_strace      22
 #define SYS_waitx       23
 #define SYS_setpriority 24
+#define SYS_mmap        25
+#define SYS_munmap      26
+#define SYS_memstat     27
+#define SYS_ksm         28
+#define SYS_bcachestat  29
+#define SYS_fadvise     30
+#define SYS_ionice      31
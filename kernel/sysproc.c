@@ -5,7 +5,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "memstat.h"
+#include "ioprio.h"
 
 uint64
 sys_exit(void)
@@ -146,3 +149,62 @@ sys_setpriority(void)
   calc_dpriority(pid, ret); // calculate dynamic priority for this process
   return ret;
 }
+
+// report free memory, page-table and swap usage
+uint64
+sys_memstat(void)
+{
+  uint64 addr; // user pointer to struct memstat
+  struct memstat st;
+  struct proc *p = myproc();
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  kmemstat(&st);
+  slabstat(&st);
+  swapstat(&st);
+  zramstat(&st);
+  ksmstat(&st);
+  vmstat(p->pagetable, &st);
+  if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// let ksmd merge identical pages of this process (on != 0)
+// or not. returns the previous setting.
+uint64
+sys_ksm(void)
+{
+  int on, old;
+  struct proc *p = myproc();
+
+  if(argint(0, &on) < 0)
+    return -1;
+  acquire(&p->lock);
+  old = p->ksm;
+  p->ksm = on != 0;
+  release(&p->lock);
+  return old;
+}
+
+// set the I/O class of this process's disk requests, one of
+// the IOCLASS_ values in ioprio.h; 0 leaves it as it is.
+// returns the previous class.
+uint64
+sys_ionice(void)
+{
+  int class, old;
+  struct proc *p = myproc();
+
+  if(argint(0, &class) < 0)
+    return -1;
+  if(class != 0 && (class < IOCLASS_RT || class > IOCLASS_IDLE))
+    return -1;
+  acquire(&p->lock);
+  old = p->ioclass;
+  if(class != 0)
+    p->ioclass = class;
+  release(&p->lock);
+  return old;
+}
@@ -0,0 +1,195 @@
+// Shared text pages.
+//
+// exec() maps the pages of read-only ELF segments from this
+// cache instead of reading a private copy, so all processes
+// running the same binary share one copy of its text.
+//
+// The cache holds a reference to each of its pages; every
+// mapping holds another. Pages are keyed by inode and file
+// offset, and hang off a small table of per-inode records.
+// Writing to or truncating an inode drops its pages from the
+// cache (processes keep the copy they have mapped), and
+// kalloc() reclaims pages that no process maps when memory
+// runs out.
+//
+// Interface:
+// * textpage(ip, off, n) returns a referenced page holding n
+//   bytes of ip at off, loading it on a miss.
+// * textinval(ip) drops ip's pages.
+// * textreclaim() frees unmapped pages.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+struct tpage {
+  uint off;             // file offset of the page
+  uint n;               // bytes read from the file, rest zero
+  uint64 pa;
+  struct tpage *next;   // next page of the same inode, or free list
+};
+
+struct tinode {
+  uint dev;
+  uint inum;
+  struct tpage *pages;  // 0 if the record is free
+};
+
+struct {
+  struct spinlock lock;
+  struct tinode inode[NTEXTINODE];
+  struct tpage page[NTEXTPAGE];
+  struct tpage *free;
+} text;
+
+void
+textinit(void)
+{
+  struct tpage *t;
+
+  initlock(&text.lock, "text");
+  for(t = text.page; t < &text.page[NTEXTPAGE]; t++){
+    t->next = text.free;
+    text.free = t;
+  }
+}
+
+// Find the record of ip.
+// Caller must hold text.lock.
+static struct tinode*
+tilookup(struct inode *ip)
+{
+  struct tinode *ti;
+
+  for(ti = text.inode; ti < &text.inode[NTEXTINODE]; ti++)
+    if(ti->pages && ti->dev == ip->dev && ti->inum == ip->inum)
+      return ti;
+  return 0;
+}
+
+// Drop pages of ti that no process has mapped, or all of its
+// pages if all is set. Returns the number of pages released.
+// Caller must hold text.lock.
+static int
+tidrop(struct tinode *ti, int all)
+{
+  struct tpage **tp, *t;
+  int n = 0;
+
+  for(tp = &ti->pages; (t = *tp) != 0; ){
+    if(all || krefcnt((void*)t->pa) == 1){
+      *tp = t->next;
+      kfree((void*)t->pa);
+      t->next = text.free;
+      text.free = t;
+      n++;
+    } else {
+      tp = &t->next;
+    }
+  }
+  return n;
+}
+
+// Return a page holding n bytes of ip at off, followed by
+// zeros, with a reference for the caller to map read-only.
+// Returns 0 if out of memory or the file is too short.
+// Caller must hold ip->lock.
+uint64
+textpage(struct inode *ip, uint off, uint n)
+{
+  struct tinode *ti;
+  struct tpage *t;
+  char *mem;
+
+  acquire(&text.lock);
+  if((ti = tilookup(ip)) != 0){
+    for(t = ti->pages; t; t = t->next){
+      if(t->off == off && t->n == n){
+        kincref((void*)t->pa);
+        release(&text.lock);
+        return t->pa;
+      }
+    }
+  }
+  release(&text.lock);
+
+  // miss: read the page in. holding ip->lock means no one
+  // else can be adding this page or invalidating ip meanwhile.
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(readi(ip, 0, (uint64)mem, off, n) != n){
+    kfree(mem);
+    return 0;
+  }
+
+  acquire(&text.lock);
+  if(text.free == 0){
+    // make room by dropping pages no process maps.
+    for(ti = text.inode; ti < &text.inode[NTEXTINODE] && text.free == 0; ti++)
+      if(ti->pages)
+        tidrop(ti, 0);
+  }
+  if((ti = tilookup(ip)) == 0){
+    for(ti = text.inode; ti < &text.inode[NTEXTINODE]; ti++)
+      if(ti->pages == 0)
+        break;
+    if(ti == &text.inode[NTEXTINODE])
+      ti = 0;
+  }
+  if(ti && (t = text.free) != 0){
+    text.free = t->next;
+    t->off = off;
+    t->n = n;
+    t->pa = (uint64)mem;
+    ti->dev = ip->dev;
+    ti->inum = ip->inum;
+    t->next = ti->pages;
+    ti->pages = t;
+    ip->text = 1;
+    kincref(mem);
+  }
+  // otherwise the cache is full of mapped pages, and the
+  // caller gets an uncached page.
+  release(&text.lock);
+
+  return (uint64)mem;
+}
+
+// The contents of ip are changing: forget its pages.
+// Caller must hold ip->lock.
+void
+textinval(struct inode *ip)
+{
+  struct tinode *ti;
+
+  if(!ip->text)
+    return;
+  acquire(&text.lock);
+  if((ti = tilookup(ip)) != 0)
+    tidrop(ti, 1);
+  ip->text = 0;
+  release(&text.lock);
+}
+
+// Free cached pages that no process has mapped.
+// Returns the number of pages freed.
+int
+textreclaim(void)
+{
+  struct tinode *ti;
+  int n = 0;
+
+  acquire(&text.lock);
+  for(ti = text.inode; ti < &text.inode[NTEXTINODE]; ti++)
+    if(ti->pages)
+      n += tidrop(ti, 0);
+  release(&text.lock);
+  return n;
+}
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -10,6 +11,7 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char uaccess[], uaccessend[], uaccessfault[];
 #ifdef MLFQ
 int time_slice[5] = {1, 2, 4, 8, 16};
 #endif
@@ -31,6 +33,16 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
+// The access a page fault's scause is for: 12 is an
+// instruction fetch, 13 a load, 15 a store.
+static int
+faultaccess(uint64 scause)
+{
+  if(scause == 12)
+    return PTE_X;
+  return scause == 15 ? PTE_W : PTE_R;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -70,6 +82,24 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault: maybe an mmap()ed page not yet present,
+    // a page that was swapped out, or a dirty bit to set.
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+
+    // reading the page in from a file may sleep.
+    intr_on();
+
+    if(vmfault(p->pagetable, va, faultaccess(scause)) == 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      p->killed = 1;
+    } else {
+      // the PTE was just written, and sfence.vma is what
+      // orders that write before the retried access.
+      tlbfixup(p, va);
+    }
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -174,8 +204,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // and the process's ASID.
+  uint64 satp = uvmsatp(p);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -203,6 +234,17 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)uaccess && sepc < (uint64)uaccessend){
+    // a copy to or from user memory touched a page that is
+    // not mapped yet, or not at all.
+    if(ukvmfault(r_stval(), faultaccess(scause)) == 0)
+      sepc = (uint64)uaccessfault;
+    w_sepc(sepc);
+    w_sstatus(sstatus);
+    return;
+  }
+
   if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -43,9 +43,9 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// at most this many virtio descriptors; fewer if the
+// device's queue is shorter. must be a power of two.
+#define MAXNUM 256
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -61,8 +61,7 @@ struct virtq_desc {
 struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
-  uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 ring[];  // descriptor numbers of chain heads
 };
 
 // one entry in the "used" ring, with which the
@@ -73,10 +72,11 @@ struct virtq_used_elem {
 };
 
 struct virtq_used {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_USED_F_NO_NOTIFY, or zero
   uint16 idx;   // device increments when it adds a ring[] entry
-  struct virtq_used_elem ring[NUM];
+  struct virtq_used_elem ring[];
 };
+#define VRING_USED_F_NO_NOTIFY 1 // device does not need to be told
 
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
@@ -22,10 +22,11 @@
 
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
-  // structures in RAM. pages[] allocates that memory. pages[] is a
-  // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // structures in RAM, which must be page-aligned, physically
+  // contiguous memory. virtio_disk_init() allocates it, with room
+  // for as many descriptors as the device's queue has (up to MAXNUM).
+  char *pages;
+  int num;         // descriptors in the queue, a power of two
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -34,7 +35,7 @@ static struct disk {
   
   // the first region of pages[] is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
-  // and write individual disk operations. there are NUM descriptors.
+  // and write individual disk operations. there are num descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   // points into pages[].
@@ -43,19 +44,20 @@ static struct disk {
   // next is a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // num elements.
   // points into pages[].
   struct virtq_avail *avail;
 
   // finally a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are num used ring entries.
   // points into pages[].
   struct virtq_used *used;
 
   // our own book-keeping.
-  char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  char free[MAXNUM];  // is a descriptor free?
+  uint16 used_idx; // we've looked this far in used[2..num].
+  uint16 kicked;   // avail->idx when we last told the device.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -63,15 +65,15 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
-  } info[NUM];
+  } info[MAXNUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
-  struct virtio_blk_req ops[NUM];
+  struct virtio_blk_req ops[MAXNUM];
   
   struct spinlock vdisk_lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} disk;
 
 void
 virtio_disk_init(void)
@@ -114,27 +116,40 @@ virtio_disk_init(void)
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
+  // initialize queue 0, as long as the device allows.
   *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < MAXCLUSTER+2)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
+  disk.num = MAXNUM;
+  while(disk.num > max)
+    disk.num /= 2;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
 
   // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // avail = after desc -- 2 * uint16, then num * uint16
+  // used = next page boundary -- 2 * uint16, then num * vRingUsedElem
+  uint64 usedoff = PGROUNDUP(disk.num*sizeof(struct virtq_desc) +
+                             sizeof(struct virtq_avail) + (disk.num+1)*sizeof(uint16));
+  uint64 size = usedoff + PGROUNDUP(sizeof(struct virtq_used) +
+                                    disk.num*sizeof(struct virtq_used_elem));
+  int order = 0;
+  while(((uint64)PGSIZE << order) < size)
+    order++;
+  if((disk.pages = kallocpages(order)) == 0)
+    panic("virtio disk queue");
+  memset(disk.pages, 0, (uint64)PGSIZE << order);
+  *R(VIRTIO_MMIO_QUEUE_ALIGN) = PGSIZE;
+  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
+  disk.avail = (struct virtq_avail *)(disk.pages + disk.num*sizeof(struct virtq_desc));
+  disk.used = (struct virtq_used *) (disk.pages + usedoff);
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all num descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
     disk.free[i] = 1;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
@@ -144,7 +159,7 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.num; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -157,7 +172,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -184,12 +199,12 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a transfer of k blocks uses k+2 descriptors.
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,28 +215,17 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// format the descriptors of a transfer of the n blocks in the
+// b->qnext list, and put the first on the avail ring. the device
+// is not told until kick(). caller holds disk.vdisk_lock.
+static void
+submit(struct buf *b, int n, int write, int *idx)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
+  int i;
 
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
+  // format the descriptors: the command, one per block,
+  // and the status. qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
@@ -237,51 +241,118 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  // the blocks need not be next to each other in memory.
+  for(i = 1; i <= n; i++, b = b->qnext){
+    disk.desc[idx[i]].addr = (uint64) b->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+    b->disk = 1;
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.num] = idx[0];
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  // another avail ring entry is available.
+  disk.avail->idx += 1; // not % num ...
+}
 
+// tell the device about the requests submit() has put on the
+// avail ring since last time: one notification for all of them.
+// caller holds disk.vdisk_lock.
+static void
+kick(void)
+{
   __sync_synchronize();
+  if(disk.kicked != disk.avail->idx &&
+     (disk.used->flags & VRING_USED_F_NO_NOTIFY) == 0)
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.kicked = disk.avail->idx;
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// queue a transfer of b, which the caller has locked, and of
+// the buffers on its b->qnext list, which must hold the blocks
+// that follow b's, at most MAXCLUSTER in all. it is one request
+// to the device. returns without waiting for it: when it
+// finishes, virtio_disk_intr() calls b->done(b) for each buffer
+// that has it set, and otherwise wakes up virtio_disk_wait().
+// the device only starts on queued requests at virtio_disk_kick()
+// or virtio_disk_wait(), so a batch of them costs one
+// notification. if the queue is full, waits for room, or
+// returns -1 if wait is 0.
+int
+virtio_disk_start(struct buf *b, int write, int wait)
+{
+  // the spec's Section 5.2 says that legacy block operations use
+  // a descriptor for type/reserved/sector, then descriptors for
+  // the data, then one for a 1-byte status result.
+  int idx[MAXCLUSTER+2];
+  struct buf *x;
+  int n = 0;
+
+  for(x = b; x; x = x->qnext){
+    if(x != b && x->blockno != b->blockno + n)
+      panic("virtio_disk_start: not contiguous");
+    n++;
+  }
+  if(n > MAXCLUSTER)
+    panic("virtio_disk_start: too long");
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  acquire(&disk.vdisk_lock);
+  while(allocn_desc(idx, n+2) < 0){
+    if(!wait){
+      release(&disk.vdisk_lock);
+      return -1;
+    }
+    // the device must get on with what is queued to make room.
+    kick();
+    sleep(&disk.free[0], &disk.vdisk_lock);
   }
+  disk.info[idx[0]].b = b;
+  submit(b, n, write, idx);
+  release(&disk.vdisk_lock);
+  return 0;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// let the device start on the requests queued so far.
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
 
+// wait for a transfer of b, queued with no b->done, to finish.
+// iowait() is the way in for the rest of the kernel.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
 void
 virtio_disk_intr()
 {
+  int n = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -299,17 +370,36 @@ virtio_disk_intr()
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    disk.info[id].b = 0;
+    free_chain(id);
+    while(b){
+      struct buf *next = b->qnext;
+      b->qnext = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->done){
+        // it must not start more disk I/O; we hold vdisk_lock.
+        void (*done)(struct buf*) = b->done;
+        b->done = 0;
+        done(b);
+      } else {
+        wakeup(b);
+      }
+      b = next;
+    }
 
     disk.used_idx += 1;
+    n++;
   }
 
   release(&disk.vdisk_lock);
+
+  // the I/O scheduler can send more.
+  if(n > 0)
+    iodone(n);
 }
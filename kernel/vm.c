@@ -5,6 +5,11 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "memstat.h"
+#include "kvec.h"
 
 /*
  * the kernel's page table.
@@ -37,14 +42,13 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
-  kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
+  kvmmap(kpgtbl, (uint64)etext, (uint64)etext, phystop-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // map kernel stacks
-  proc_mapstacks(kpgtbl);
+  // kernel stacks are mapped by allocproc() as needed.
   
   return kpgtbl;
 }
@@ -61,10 +65,211 @@ kvminit(void)
 void
 kvminithart()
 {
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
   sfence_vma();
 }
 
+// Per-process kernel page tables.
+//
+// A process runs in the kernel on a page table of its own,
+// which maps everything the kernel page table does and, below
+// UKVMTOP, the process's user memory as well, so that copyin()
+// and copyout() can load and store user addresses directly,
+// with sstatus.SUM set. The two tables share their level-0
+// page-table pages, so PTE changes show up in both; only the
+// level-1 PTEs for user memory are copied, by ukvmsync().
+// A copy that touches a page that is not there faults, and
+// kerneltrap() calls ukvmfault(), which does what a user page
+// fault would.
+//
+// The kernel's mappings run with ASID 0 in every one of these
+// tables, so kvmswitch() flushes ASID 0 whenever it loads one.
+
+// Make a kernel page table for a new process, with no user
+// memory in it yet. Returns 0 if out of memory.
+pagetable_t
+ukvmcreate(void)
+{
+  pagetable_t kpt, l1;
+
+  if((kpt = (pagetable_t)kalloc()) == 0)
+    return 0;
+  if((l1 = (pagetable_t)kalloc()) == 0){
+    kfree(kpt);
+    return 0;
+  }
+  // the top level is shared with kernel_pagetable but for the
+  // first 1 GB, which holds the devices and user memory.
+  memmove(kpt, kernel_pagetable, PGSIZE);
+  memmove(l1, (void*)PTE2PA(kernel_pagetable[0]), PGSIZE);
+  kpt[0] = PA2PTE(l1) | PTE_V;
+  return kpt;
+}
+
+void
+ukvmfree(pagetable_t kpt)
+{
+  kfree((void*)PTE2PA(kpt[0]));
+  kfree(kpt);
+}
+
+// Bring p's kernel page table up to date with the level-1
+// PTEs of p's user page table below UKVMTOP.
+void
+ukvmsync(struct proc *p)
+{
+  pagetable_t upt = 0, kpt;
+  pte_t pte = p->pagetable[0];
+
+  if(p->kpagetable == 0)
+    return;
+  if((pte & PTE_V) && !PTE_LEAF(pte))
+    upt = (pagetable_t)PTE2PA(pte);
+  kpt = (pagetable_t)PTE2PA(p->kpagetable[0]);
+  for(int i = 0; i < PX(1, UKVMTOP); i++)
+    kpt[i] = upt ? upt[i] : 0;
+  if(p == myproc())
+    sfence_vma_asid(0);
+}
+
+// Run the kernel on p's kernel page table, or on the global
+// one if p is 0 or has none. Called by the scheduler around
+// swtch(), with interrupts off.
+void
+kvmswitch(struct proc *p)
+{
+  w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+  if(p && p->kpagetable){
+    w_satp(MAKE_SATP(p->kpagetable, 0));
+    // the TLB may hold another process's user memory.
+    sfence_vma_asid(0);
+  } else {
+    w_satp(MAKE_SATP(kernel_pagetable, 0));
+  }
+}
+
+// A copy through the current process's kernel page table
+// faulted at va, for access PTE_R or PTE_W. Fault the page in
+// as for the process itself. Returns 1 if the copy can be
+// retried, or 0 if the access is not allowed. Called by
+// kerneltrap() with interrupts off.
+int
+ukvmfault(uint64 va, int access)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+
+  if(p == 0 || p->kpagetable == 0 || va >= UKVMTOP)
+    return 0;
+  // vmfault() may sleep.
+  w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+  intr_on();
+  pa = vmfault(p->pagetable, va, access);
+  intr_off();
+  if(pa == 0)
+    return 0;
+  // a new page-table page or megapage may have been mapped.
+  ukvmsync(p);
+  return 1;
+}
+
+// Address-space identifiers.
+//
+// Each user page table runs with its own ASID, so that TLB
+// entries survive traps and context switches; the kernel runs
+// with ASID 0, flushed when kvmswitch() changes kernel page
+// tables.
+//
+// ASIDs are handed out in generations. When a generation's
+// ASIDs run out, a new one starts, and each hart flushes its
+// whole TLB before it first uses an ASID of the new generation.
+// So a process whose mappings are removed or made stricter
+// need not flush its ASID on every hart it has run on: it just
+// gives it up and gets a fresh one on its way back to user space.
+struct {
+  struct spinlock lock;
+  uint64 mask;  // ASIDs the hardware supports; 0 if none
+  uint64 gen;   // current generation, in the bits above mask
+  uint64 next;  // next ASID to hand out
+} asids;
+
+// Find out how many ASID bits the hardware implements.
+void
+asidinit(void)
+{
+  initlock(&asids.lock, "asid");
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASID_MASK));
+  asids.mask = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
+  asids.gen = asids.mask + 1;
+  asids.next = 1;
+}
+
+// Return the satp value for p's page table, giving p a new
+// ASID if it has none from the current generation. Must be
+// called with interrupts off, on the way back to user space.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  if(asids.mask == 0)
+    return MAKE_SATP(p->pagetable, 0);  // trampoline flushes
+
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if((p->asid & ~asids.mask) != gen){
+    acquire(&asids.lock);
+    if((p->asid & ~asids.mask) != asids.gen){
+      if(asids.next > asids.mask){
+        // out of ASIDs: start a new generation.
+        __atomic_store_n(&asids.gen, asids.gen + asids.mask + 1, __ATOMIC_RELEASE);
+        asids.next = 1;
+      }
+      p->asid = asids.gen | asids.next++;
+    }
+    gen = asids.gen;
+    release(&asids.lock);
+  }
+
+  if(c->asidgen != gen){
+    sfence_vma();
+    c->asidgen = gen;
+  }
+  return MAKE_SATP(p->pagetable, p->asid & asids.mask);
+}
+
+// The mappings of p's page table have been removed or
+// restricted: stop using its ASID, which may have stale
+// TLB entries on any hart.
+void
+asidretire(struct proc *p)
+{
+  p->asid = 0;
+}
+
+// The mappings of pagetable have been removed or restricted.
+static void
+tlbinval(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  // other page tables are not in use: they belong to a
+  // process being created or torn down, or to exec().
+  if(p && p->pagetable == pagetable){
+    asidretire(p);
+    ukvmsync(p);
+  }
+}
+
+// After a page fault on va that was fixed up by changing its
+// PTE, make sure this hart's TLB sees the new PTE.
+void
+tlbfixup(struct proc *p, uint64 va)
+{
+  sfence_vma_page(PGROUNDDOWN(va), p->asid & asids.mask);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -77,15 +282,24 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE can also be a leaf, mapping a 2 MB megapage;
+// then that PTE is returned. If level is not 0, *level is
+// set to the level of the returned PTE.
 pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > 0; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        if(level)
+          *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -94,9 +308,25 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
+  if(level)
+    *level = 0;
   return &pagetable[PX(0, va)];
 }
 
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Physical address of the page holding va,
+// given the leaf PTE that maps va at level.
+static uint64
+leafpa(pte_t pte, int level, uint64 va)
+{
+  return PTE2PA(pte) + PGROUNDDOWN(va & ((1L << PXSHIFT(level)) - 1));
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -104,19 +334,114 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  return leafpa(*pte, level, va);
+}
+
+// If pagetable is the current process's, keep the swap
+// reclaimer out of it. Returns 1 if p->vmlock was acquired
+// and must be released with uvmunlock().
+static int
+uvmlock(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable || holdingsleep(&p->vmlock))
+    return 0;
+  acquiresleep(&p->vmlock);
+  return 1;
+}
+
+static void
+uvmunlock(int locked)
+{
+  if(locked)
+    releasesleep(&myproc()->vmlock);
+}
+
+// A store to a page that page merging shares: give the
+// page table its own copy, or the page itself if no one else
+// maps it any more. Returns 0, or -1 if out of memory.
+static int
+cowbreak(pagetable_t pagetable, pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  char *mem;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+  } else {
+    if((mem = ualloc()) == 0)
+      return -1;
+    memmove(mem, (void*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kfree((void*)pa);
+  }
+  // the TLB may hold the read-only mapping.
+  tlbinval(pagetable);
+  return 0;
+}
+
+// vmfault(), with the reclaimer kept out.
+static uint64
+fault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  int level, write = access == PTE_W;
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte && (*pte & PTE_SWAP)){
+    if(swapin(pte) < 0)
+      return 0;
+  } else if(pte == 0 || (*pte & PTE_V) == 0){
+    if(p == 0 || pagetable != p->pagetable)
+      return 0;
+    if(mmapfault(p, va, write) == 0)
+      return 0;
+    pte = walklevel(pagetable, va, 0, &level);
+  }
+  if((*pte & PTE_U) == 0)
+    return 0;
+  if(write && (*pte & PTE_COW) && cowbreak(pagetable, pte) < 0)
+    return 0;
+  if((*pte & access) == 0)
+    return 0;
+  *pte |= PTE_A | (write ? PTE_D : 0);
+  return leafpa(*pte, level, va);
+}
+
+// Handle a user page fault at va, from a trap or on behalf of
+// copyin()/copyout(). access is PTE_R for a load, PTE_W for a
+// store, or PTE_X for an instruction fetch. Keeps the accessed
+// and dirty bits of present pages up to date, reads swapped-out
+// pages back in, and faults in mmap()ed pages.
+// Return the physical address of the page, or 0 if the
+// access is not allowed.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int access)
+{
+  uint64 pa;
+  int locked;
+
+  if(va >= MAXVA)
+    return 0;
+
+  locked = uvmlock(pagetable);
+  pa = fault(pagetable, va, access);
+  uvmunlock(locked);
   return pa;
 }
 
@@ -130,10 +455,59 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// Return the level-1 PTE for va if a megapage can be mapped
+// there, i.e. nothing is mapped in the 2 MB around va.
+// Frees a level-0 page-table page that is in the way but
+// empty. Returns 0 if the slot is in use or out of memory.
+static pte_t *
+megaslot(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+  pagetable_t pt;
+
+  if((*pte & PTE_V) == 0){
+    if((pt = (pagetable_t)kalloc()) == 0)
+      return 0;
+    memset(pt, 0, PGSIZE);
+    *pte = PA2PTE(pt) | PTE_V;
+  } else if(PTE_LEAF(*pte)){
+    return 0;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0)
+    return pte;
+  if(PTE_LEAF(*pte))
+    return 0;
+  pt = (pagetable_t)PTE2PA(*pte);
+  for(int i = 0; i < 512; i++)
+    if(pt[i] != 0)  // mapped or swapped out
+      return 0;
+  kfree(pt);
+  *pte = 0;
+  // the TLB may still cache the freed page-table page.
+  tlbinval(pagetable);
+  return pte;
+}
+
+// Map the megapage at pa at va; both must be 2 MB-aligned.
+// Returns 0 on success, or -1 if megaslot() fails.
+static int
+megamap(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+
+  if((pte = megaslot(pagetable, va)) == 0)
+    return -1;
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
+// Uses megapages for parts of the range where va and pa are
+// both 2 MB-aligned and nothing else is mapped yet.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
@@ -146,6 +520,14 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
+    if((a % MEGASIZE) == 0 && (pa % MEGASIZE) == 0 &&
+       last - a >= MEGASIZE - PGSIZE && megamap(pagetable, a, pa, perm) == 0){
+      if(last - a == MEGASIZE - PGSIZE)
+        break;
+      a += MEGASIZE;
+      pa += MEGASIZE;
+      continue;
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
@@ -159,31 +541,120 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+// Split the megapage mapped by the level-1 PTE pte into pages,
+// because the page at a in it is about to be unmapped.
+// If do_free, that page becomes the new page-table page and
+// 0 is returned; otherwise returns the level-0 PTE for a.
+static pte_t *
+demote(pte_t *pte, uint64 a, int do_free)
 {
-  uint64 a;
+  uint64 pa = PTE2PA(*pte);
+  int flags = PTE_FLAGS(*pte);
+  pagetable_t pt;
+
+  if(do_free)
+    pt = (pagetable_t)(pa + (a % MEGASIZE));
+  else if((pt = (pagetable_t)kalloc()) == 0)
+    panic("demote");
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  if(do_free){
+    pt[PX(0, a)] = 0;
+    return 0;
+  }
+  return &pt[PX(0, a)];
+}
+
+// Remove npages of mappings starting from va, optionally
+// freeing the physical memory. If lazy, pages that are not
+// mapped are skipped; otherwise they are an error.
+static void
+unmaprange(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int lazy)
+{
+  uint64 a, end;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0){
+      if(lazy)
+        continue;
       panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
+    }
+    if(*pte & PTE_SWAP){
+      if(do_free)
+        swapfree(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
+    if((*pte & PTE_V) == 0){
+      if(lazy)
+        continue;
       panic("uvmunmap: not mapped");
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level == 1){
+      if((a % MEGASIZE) == 0 && end - a >= MEGASIZE){
+        if(do_free)
+          superfree((void*)PTE2PA(*pte));
+        *pte = 0;
+        a += MEGASIZE - PGSIZE;
+        continue;
+      }
+      // unmapping only part of a megapage.
+      if((pte = demote(pte, a, do_free)) == 0)
+        continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
   }
+  // after the loop: it may have freed megapages.
+  if(npages > 0)
+    tlbinval(pagetable);
+}
+
+// Remove npages of mappings starting from va. va must be
+// page-aligned. The mappings must exist.
+// Optionally free the physical memory.
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmaprange(pagetable, va, npages, do_free, 0);
+}
+
+// Remove and free whichever of the npages starting at va
+// are mapped, for regions that are filled in lazily.
+void
+uvmunmaplazy(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  unmaprange(pagetable, va, npages, 1, 1);
+}
+
+// Map a zeroed megapage at va, which must be 2 MB-aligned and
+// have nothing mapped in the 2 MB from it. Returns the physical
+// address, or 0 if there is no free megapage or no room.
+uint64
+uvmmega(pagetable_t pagetable, uint64 va, int perm)
+{
+  pte_t *pte;
+  char *mem;
+
+  if((pte = megaslot(pagetable, va)) == 0)
+    return 0;
+  if((mem = superalloc()) == 0)
+    return 0;
+  memset(mem, 0, MEGASIZE);
+  *pte = PA2PTE(mem) | perm | PTE_V;
+  return (uint64)mem;
 }
 
 // create an empty user page table.
@@ -217,6 +688,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Uses megapages for aligned 2 MB pieces of the range when it can.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -228,7 +700,12 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    if((a % MEGASIZE) == 0 && newsz - a >= MEGASIZE &&
+       uvmmega(pagetable, a, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+      a += MEGASIZE - PGSIZE;
+      continue;
+    }
+    mem = ualloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
@@ -291,42 +768,94 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
-// returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
-int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+// Copy the mappings of [va, end) from old to new, along with the
+// physical memory, except that read-only pages (shared text)
+// are shared, and so are the swap slots of swapped-out pages.
+// Megapages are copied into megapages if possible.
+// If lazy, pages not mapped in old are skipped.
+// Returns the address up to which the copy succeeded, or end.
+static uint64
+copyrange(pagetable_t old, pagetable_t new, uint64 va, uint64 end, int lazy)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
   char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
+  for(i = va; i < end; i += PGSIZE){
+    if((pte = walklevel(old, i, 0, &level)) != 0 && (*pte & PTE_SWAP)){
+      if((npte = walk(new, i, 1)) == 0)
+        return i;
+      swapdup(PTE2SLOT(*pte));
+      *npte = *pte;
+      continue;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      if(lazy)
+        continue;
+      if(pte == 0)
+        panic("uvmcopy: pte should exist");
       panic("uvmcopy: page not present");
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
+    if(level == 1){
+      if((i % MEGASIZE) == 0 && end - i >= MEGASIZE && (mem = superalloc()) != 0){
+        memmove(mem, (char*)pa, MEGASIZE);
+        if(megamap(new, i, (uint64)mem, flags) == 0){
+          i += MEGASIZE - PGSIZE;
+          continue;
+        }
+        superfree(mem);
+      }
+      // copy the megapage one page at a time.
+      pa = leafpa(*pte, level, i);
+    } else if((flags & PTE_W) == 0){
+      if(mappages(new, i, PGSIZE, pa, flags) != 0)
+        return i;
+      kincref((void*)pa);
+      continue;
+    }
+    if((mem = ualloc()) == 0)
+      return i;
     memmove(mem, (char*)pa, PGSIZE);
     if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
       kfree(mem);
-      goto err;
+      return i;
     }
   }
-  return 0;
+  return end;
+}
 
- err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+// Given a parent process's page table, copy
+// its memory into a child's page table.
+// Copies both the page table and the
+// physical memory, except that read-only
+// pages (shared text) are shared.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  uint64 i;
+
+  if((i = copyrange(old, new, 0, sz, 0)) == sz)
+    return 0;
+  uvmunmap(new, 0, PGROUNDUP(i) / PGSIZE, 1);
   return -1;
 }
 
+// Copy the pages of [va, end) that are mapped in old into new,
+// for regions that are filled in lazily.
+// Returns 0 on success, -1 on failure, leaving whatever was
+// copied for the caller to unmap.
+int
+uvmcopylazy(pagetable_t old, pagetable_t new, uint64 va, uint64 end)
+{
+  return copyrange(old, new, va, end, 1) == end ? 0 : -1;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -337,59 +866,170 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  // not readable or writable either, so that copies through the
+  // kernel page table fault on it too; PTE_X keeps it a leaf.
+  *pte = (*pte & ~(PTE_U|PTE_R|PTE_W)) | PTE_X;
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+// Copying to and from user memory. A cursor remembers the
+// level-0 page-table page (or the megapage) that mapped the
+// last page copied, so that the pages after it are found
+// without walking the page table from the top. Only a PTE
+// that allows the access outright is used that way; anything
+// else goes through vmfault(). The caller holds p->vmlock,
+// so the page-table pages stay put.
+//
+// The current process's memory below UKVMTOP is not walked
+// at all: the kernel page table maps it, and uaccess.S copies
+// it with plain loads and stores.
+struct ucursor {
+  pagetable_t pagetable;
+  uint64 base;          // first address the cursor covers
+  pte_t *tbl;           // level-0 table, or megapage PTE, or 0
+  int mega;
+  int direct;           // pagetable is mapped below UKVMTOP
+};
+
+static void
+ucursorinit(struct ucursor *c, pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  c->pagetable = pagetable;
+  c->tbl = 0;
+  c->direct = p && p->pagetable == pagetable && p->kpagetable;
+}
+
+// Return the physical address of the user page at va, for a
+// copy into it if write. Returns 0 if the access is not allowed.
+static uint64
+upage(struct ucursor *c, uint64 va, int write)
+{
+  pte_t pte, *ptep;
+  uint64 pa, need;
+  int level;
+
+  need = PTE_V | PTE_U | PTE_A | (write ? PTE_W | PTE_D : PTE_R);
+  if(c->tbl && MEGAROUNDDOWN(va) == c->base){
+    pte = c->mega ? *c->tbl : c->tbl[PX(0, va)];
+    if((pte & need) == need)
+      return PTE2PA(pte) + (c->mega ? va - c->base : 0);
+  }
+
+  if((pa = vmfault(c->pagetable, va, write ? PTE_W : PTE_R)) == 0)
+    return 0;
+  ptep = walklevel(c->pagetable, va, 0, &level);
+  c->base = MEGAROUNDDOWN(va);
+  c->mega = level == 1;
+  if(level == 0)
+    c->tbl = (pte_t*)PGROUNDDOWN((uint64)ptep);
+  else
+    c->tbl = level == 1 ? ptep : 0;
+  return pa;
+}
+
+// Copy len bytes between user address va and kernel address k,
+// to user memory if out. Return 0 on success, -1 on error.
+static int
+ucopyrange(struct ucursor *c, uint64 va, char *k, uint64 len, int out)
 {
   uint64 n, va0, pa0;
 
+  if(c->direct && va < UKVMTOP && len <= UKVMTOP - va){
+    if(out)
+      return uaccesscopy((char*)va, k, len);
+    return uaccesscopy(k, (char*)va, len);
+  }
+
   while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    va0 = PGROUNDDOWN(va);
+    if((pa0 = upage(c, va0, out)) == 0)
       return -1;
-    n = PGSIZE - (dstva - va0);
+    n = PGSIZE - (va - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
-
+    if(out)
+      memmove((char*)(pa0 + (va - va0)), k, n);
+    else
+      memmove(k, (char*)(pa0 + (va - va0)), n);
     len -= n;
-    src += n;
-    dstva = va0 + PGSIZE;
+    k += n;
+    va += n;
   }
   return 0;
 }
 
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// Return 0 on success, -1 on error.
+int
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  struct ucursor c;
+  int locked, r;
+
+  locked = uvmlock(pagetable);
+  ucursorinit(&c, pagetable);
+  r = ucopyrange(&c, dstva, src, len, 1);
+  uvmunlock(locked);
+  return r;
+}
+
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  struct ucursor c;
+  int locked, r;
 
-  while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
-    n = PGSIZE - (srcva - va0);
-    if(n > len)
-      n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+  locked = uvmlock(pagetable);
+  ucursorinit(&c, pagetable);
+  r = ucopyrange(&c, srcva, dst, len, 0);
+  uvmunlock(locked);
+  return r;
+}
 
-    len -= n;
-    dst += n;
-    srcva = va0 + PGSIZE;
+// Gather the n pieces of kernel memory in kv into consecutive
+// user memory at dstva. Return 0 on success, -1 on error.
+int
+copyoutv(pagetable_t pagetable, uint64 dstva, struct kvec *kv, int n)
+{
+  struct ucursor c;
+  int locked, r = 0;
+
+  locked = uvmlock(pagetable);
+  ucursorinit(&c, pagetable);
+  for(int i = 0; i < n && r == 0; i++){
+    r = ucopyrange(&c, dstva, kv[i].addr, kv[i].len, 1);
+    dstva += kv[i].len;
   }
-  return 0;
+  uvmunlock(locked);
+  return r;
 }
 
+// Scatter consecutive user memory at srcva into the n pieces
+// of kernel memory in kv. Return 0 on success, -1 on error.
+int
+copyinv(pagetable_t pagetable, struct kvec *kv, int n, uint64 srcva)
+{
+  struct ucursor c;
+  int locked, r = 0;
+
+  locked = uvmlock(pagetable);
+  ucursorinit(&c, pagetable);
+  for(int i = 0; i < n && r == 0; i++){
+    r = ucopyrange(&c, srcva, kv[i].addr, kv[i].len, 0);
+    srcva += kv[i].len;
+  }
+  uvmunlock(locked);
+  return r;
+}
+
+// Does the word w have a zero byte?
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
@@ -397,20 +1037,40 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
+  struct ucursor c;
   uint64 n, va0, pa0;
   int got_null = 0;
+  int locked;
 
+  locked = uvmlock(pagetable);
+  ucursorinit(&c, pagetable);
+  if(c.direct && srcva < UKVMTOP && max <= UKVMTOP - srcva){
+    got_null = uaccessstr(dst, (char*)srcva, max) == 0;
+    max = 0;
+  }
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa0 = upage(&c, va0, 0);
+    if(pa0 == 0){
+      uvmunlock(locked);
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
     char *p = (char *) (pa0 + (srcva - va0));
     while(n > 0){
+      // a word at a time, while there is no '\0' in it.
+      if(n >= 8 && (((uint64)p | (uint64)dst) & 7) == 0 &&
+         !HASZERO(*(uint64*)p)){
+        *(uint64*)dst = *(uint64*)p;
+        n -= 8;
+        max -= 8;
+        p += 8;
+        dst += 8;
+        continue;
+      }
       if(*p == '\0'){
         *dst = '\0';
         got_null = 1;
@@ -426,9 +1086,39 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
     srcva = va0 + PGSIZE;
   }
+  uvmunlock(locked);
   if(got_null){
     return 0;
   } else {
     return -1;
   }
 }
+
+// Count the page-table pages and megapages of pagetable.
+static void
+ptcount(pagetable_t pagetable, int level, uint64 *ptpages, uint64 *megapages)
+{
+  *ptpages += 1;
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(PTE_LEAF(pte)){
+      if(level == 1)
+        *megapages += 1;
+    } else if(level > 0){
+      ptcount((pagetable_t)PTE2PA(pte), level-1, ptpages, megapages);
+    }
+  }
+}
+
+// Report the page-table memory of pagetable
+// and of the kernel page table.
+void
+vmstat(pagetable_t pagetable, struct memstat *st)
+{
+  st->ptpages = st->megapages = 0;
+  ptcount(pagetable, 2, &st->ptpages, &st->megapages);
+  st->kptpages = st->kmegapages = 0;
+  ptcount(kernel_pagetable, 2, &st->kptpages, &st->kmegapages);
+}
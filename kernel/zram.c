@@ -0,0 +1,308 @@
+// Compressed swap in memory, in front of the swap area on disk.
+//
+// swapout() first tries to keep an evicted page here, compressed
+// with a small LZ77 compressor, and only writes it to disk if it
+// does not compress to half a page or the pool is full. Reading
+// a page back is then a decompression rather than disk I/O.
+//
+// A compressed page is a struct zpage in one of a few slab caches,
+// sized so that 2, 3, 4, ... of them fit in a slab page. Its
+// address is what the PTE_SWAP PTE holds instead of a disk slot;
+// see ZRAMSLOT().
+//
+// Interface:
+// * zramstore(pa) compresses a page, returning the slot or 0.
+// * zramload(slot, pa) decompresses it.
+// * zramdup(slot) and zramfree(slot) count references.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define NZCLASS 9
+#define LZHASHBITS 12
+#define LZMINMATCH 4
+#define LZLAST 5    // bytes at the end of a page are always literals
+
+struct zpage {
+  ushort ref;        // page tables that refer to this page
+  ushort len;        // compressed bytes in data
+  uchar data[];
+};
+
+// objects per slab page for each size class.
+static int zper[NZCLASS] = { 32, 16, 12, 8, 6, 5, 4, 3, 2 };
+static char *znames[NZCLASS] = { "zram-32", "zram-16", "zram-12",
+                                 "zram-8", "zram-6", "zram-5",
+                                 "zram-4", "zram-3", "zram-2" };
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache *cache[NZCLASS];
+  uint size[NZCLASS];     // object size of each class
+  uint64 limit;           // most bytes the pool may hold
+  uint64 npage;           // pages held
+  uint64 nbytes;          // their compressed size
+  uint64 pool;            // bytes of objects holding them
+} zram;
+
+// the compressor's scratch space.
+static struct {
+  struct sleeplock lock;
+  ushort hash[1 << LZHASHBITS];  // last offset of each 4-byte hash
+  uchar out[PGSIZE];
+} lz;
+
+void
+zraminit(void)
+{
+  int i;
+
+  initlock(&zram.lock, "zram");
+  initsleeplock(&lz.lock, "lz");
+  for(i = 0; i < NZCLASS; i++){
+    // leave room for the slab header.
+    zram.size[i] = ((PGSIZE - 64) / zper[i]) & ~7;
+    zram.cache[i] = kmem_cache_create(znames[i], zram.size[i]);
+  }
+  // at most a quarter of memory.
+  zram.limit = (phystop - KERNBASE) / 4;
+}
+
+static uint
+lzhash(const uchar *p)
+{
+  uint v = p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+  return (v * 2654435761U) >> (32 - LZHASHBITS);
+}
+
+// Append a sequence: nlit literal bytes from lit, then a match of
+// mlen bytes at distance off back, or no match if mlen is 0.
+// Returns -1 if it does not fit before oend.
+static int
+lzemit(uchar **opp, uchar *oend, const uchar *lit, int nlit, int off, int mlen)
+{
+  uchar *op = *opp;
+  int m = mlen ? mlen - LZMINMATCH : 0;
+  int l;
+
+  if(op + 1 + nlit/255 + 1 + nlit + 2 + m/255 + 1 > oend)
+    return -1;
+  *op++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+  if(nlit >= 15){
+    for(l = nlit - 15; l >= 255; l -= 255)
+      *op++ = 255;
+    *op++ = l;
+  }
+  memmove(op, lit, nlit);
+  op += nlit;
+  if(mlen){
+    *op++ = off;
+    *op++ = off >> 8;
+    if(m >= 15){
+      for(l = m - 15; l >= 255; l -= 255)
+        *op++ = 255;
+      *op++ = l;
+    }
+  }
+  *opp = op;
+  return 0;
+}
+
+// Compress the n bytes at src into at most max bytes at dst,
+// as a series of (literals, match) sequences in the style of
+// LZ4. Returns the compressed length, or -1 if it is too long.
+// Caller must hold lz.lock.
+static int
+lzcompress(const uchar *src, int n, uchar *dst, int max)
+{
+  const uchar *ip, *anchor, *ref, *end = src + n;
+  uchar *op = dst;
+  int mlen;
+  uint h;
+
+  memset(lz.hash, 0, sizeof(lz.hash));
+  ip = anchor = src;
+  while(ip + LZMINMATCH <= end - LZLAST){
+    h = lzhash(ip);
+    ref = src + lz.hash[h];
+    lz.hash[h] = ip - src;
+    if(ref >= ip || ref[0] != ip[0] || ref[1] != ip[1] ||
+       ref[2] != ip[2] || ref[3] != ip[3]){
+      ip++;
+      continue;
+    }
+    mlen = LZMINMATCH;
+    while(ip + mlen < end - LZLAST && ip[mlen] == ref[mlen])
+      mlen++;
+    if(lzemit(&op, dst + max, anchor, ip - anchor, ip - ref, mlen) < 0)
+      return -1;
+    ip += mlen;
+    anchor = ip;
+  }
+  if(lzemit(&op, dst + max, anchor, end - anchor, 0, 0) < 0)
+    return -1;
+  return op - dst;
+}
+
+// Expand n compressed bytes at src into at most max bytes at dst.
+// Returns the expanded length, or -1 if src is malformed.
+static int
+lzdecompress(const uchar *src, int n, uchar *dst, int max)
+{
+  const uchar *ip = src, *iend = src + n;
+  uchar *op = dst, *oend = dst + max, *ref;
+  int token, nlit, mlen, off, b;
+
+  while(ip < iend){
+    token = *ip++;
+    nlit = token >> 4;
+    if(nlit == 15){
+      do {
+        if(ip >= iend)
+          return -1;
+        nlit += (b = *ip++);
+      } while(b == 255);
+    }
+    if(ip + nlit > iend || op + nlit > oend)
+      return -1;
+    memmove(op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if(ip == iend)
+      break;  // the last sequence has no match
+
+    if(ip + 2 > iend)
+      return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    mlen = token & 15;
+    if(mlen == 15){
+      do {
+        if(ip >= iend)
+          return -1;
+        mlen += (b = *ip++);
+      } while(b == 255);
+    }
+    mlen += LZMINMATCH;
+    if(off == 0 || off > op - dst || op + mlen > oend)
+      return -1;
+    // byte by byte: the match may overlap what it produces.
+    for(ref = op - off; mlen > 0; mlen--)
+      *op++ = *ref++;
+  }
+  return op - dst;
+}
+
+// Compress the page at pa into the pool.
+// Returns its slot, or 0 if it does not compress well
+// enough or the pool is full.
+uint64
+zramstore(void *pa)
+{
+  struct zpage *z;
+  int n, c;
+
+  acquiresleep(&lz.lock);
+  n = lzcompress(pa, PGSIZE, lz.out, zram.size[NZCLASS-1] - sizeof(struct zpage));
+  if(n < 0){
+    releasesleep(&lz.lock);
+    return 0;
+  }
+  for(c = 0; zram.size[c] < sizeof(struct zpage) + n; c++)
+    ;
+  acquire(&zram.lock);
+  if(zram.pool + zram.size[c] > zram.limit ||
+     (z = kmem_cache_alloc(zram.cache[c])) == 0){
+    release(&zram.lock);
+    releasesleep(&lz.lock);
+    return 0;
+  }
+  z->ref = 1;
+  z->len = n;
+  memmove(z->data, lz.out, n);
+  zram.npage++;
+  zram.nbytes += n;
+  zram.pool += zram.size[c];
+  release(&zram.lock);
+  releasesleep(&lz.lock);
+  return (uint64)z;
+}
+
+// Decompress the page in slot into pa.
+void
+zramload(uint64 slot, void *pa)
+{
+  struct zpage *z = (struct zpage*)slot;
+
+  if(lzdecompress(z->data, z->len, pa, PGSIZE) != PGSIZE)
+    panic("zramload");
+}
+
+static int
+zclass(struct zpage *z)
+{
+  int c;
+
+  for(c = 0; zram.size[c] < sizeof(struct zpage) + z->len; c++)
+    ;
+  return c;
+}
+
+// Another page table now refers to slot.
+void
+zramdup(uint64 slot)
+{
+  struct zpage *z = (struct zpage*)slot;
+
+  acquire(&zram.lock);
+  if(z->ref == 0 || z->ref == 0xffff)
+    panic("zramdup");
+  z->ref++;
+  release(&zram.lock);
+}
+
+// Drop a reference to slot.
+void
+zramfree(uint64 slot)
+{
+  struct zpage *z = (struct zpage*)slot;
+  int c;
+
+  acquire(&zram.lock);
+  if(z->ref == 0)
+    panic("zramfree");
+  if(--z->ref > 0){
+    release(&zram.lock);
+    return;
+  }
+  c = zclass(z);
+  zram.npage--;
+  zram.nbytes -= z->len;
+  zram.pool -= zram.size[c];
+  kmem_cache_free(zram.cache[c], z);
+  release(&zram.lock);
+}
+
+// Is the pool too full to take another page?
+int
+zramfull(void)
+{
+  return zram.pool + zram.size[NZCLASS-1] > zram.limit;
+}
+
+// Report what the pool holds.
+void
+zramstat(struct memstat *st)
+{
+  acquire(&zram.lock);
+  st->zrampages = zram.npage;
+  st->zrambytes = zram.nbytes;
+  st->zrampool = zram.pool;
+  release(&zram.lock);
+}
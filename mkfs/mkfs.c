@@ -77,8 +77,20 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  // -l sets the number of log blocks, header included.
+  if(argc >= 3 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    if(nlog < MAXOPBLOCKS+1 || nlog > MAXLOGSIZE+1){
+      fprintf(stderr, "mkfs: log must have %d to %d blocks\n",
+              MAXOPBLOCKS+1, MAXLOGSIZE+1);
+      exit(1);
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
     exit(1);
   }
 
@@ -101,13 +113,15 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.swapstart = xint(FSSIZE);
+  sb.nswap = xint(SWAPSIZE);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
+  for(i = 0; i < FSSIZE + SWAPSIZE; i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
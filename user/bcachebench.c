@@ -0,0 +1,108 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/bcstat.h"
+#include "user/user.h"
+
+// Contention in the buffer cache: 1, 2, 4 and 8 processes,
+// each reading a small file of its own over and over. The
+// blocks stay cached, so the time goes on looking them up;
+// with the harts to run them, more readers should get more
+// reads done per tick.
+
+#define MAXREADERS 8
+#define FILEBLOCKS 8
+#define ROUNDS 2000
+
+static char buf[BSIZE];
+
+static void
+makefile(int i)
+{
+  char name[] = "bcbench0";
+  int fd;
+
+  name[7] = '0' + i;
+  if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+    printf("bcachebench: cannot create %s\n", name);
+    exit(1);
+  }
+  for(int b = 0; b < FILEBLOCKS; b++)
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("bcachebench: write failed\n");
+      exit(1);
+    }
+  close(fd);
+}
+
+static void
+reader(int i)
+{
+  char name[] = "bcbench0";
+  int fd;
+
+  name[7] = '0' + i;
+  if((fd = open(name, O_RDONLY)) < 0){
+    printf("bcachebench: cannot open %s\n", name);
+    exit(1);
+  }
+  for(int r = 0; r < ROUNDS; r++){
+    for(int b = 0; b < FILEBLOCKS; b++)
+      if(read(fd, buf, BSIZE) != BSIZE){
+        printf("bcachebench: read failed\n");
+        exit(1);
+      }
+    // back to the start.
+    close(fd);
+    if((fd = open(name, O_RDONLY)) < 0)
+      exit(1);
+  }
+  close(fd);
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, start, t;
+  struct bcstat st;
+
+  memset(buf, 'b', sizeof(buf));
+  for(i = 0; i < MAXREADERS; i++)
+    makefile(i);
+
+  for(n = 1; n <= MAXREADERS; n *= 2){
+    start = uptime();
+    for(i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("bcachebench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        reader(i);
+    }
+    for(i = 0; i < n; i++)
+      wait(0);
+    t = uptime() - start;
+    if(t == 0)
+      t = 1;
+    printf("%d readers: %d block reads in %d ticks, %d per tick\n",
+           n, n * ROUNDS * FILEBLOCKS, t, n * ROUNDS * FILEBLOCKS / t);
+  }
+
+  if(bcachestat(&st) == 0){
+    printf("cache: %d buffers (%d to %d), %d grown, %d freed\n",
+           (int)st.nbuf, (int)st.minbuf, (int)st.maxbuf, (int)st.grows, (int)st.shrinks);
+    printf("lookups: %d hits, %d misses, %d evictions\n",
+           (int)st.hits, (int)st.misses, (int)st.evictions);
+  }
+
+  for(i = 0; i < MAXREADERS; i++){
+    char name[] = "bcbench0";
+    name[7] = '0' + i;
+    unlink(name);
+  }
+  exit(0);
+}
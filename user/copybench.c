@@ -0,0 +1,109 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Measure how fast the kernel moves data: copyout() of cached
+// file blocks to a buffer that is word-aligned with them and to
+// one that is not, a pipe (copyin() and copyout() through the
+// pipe's bounce buffer), and zeroing the pages that sbrk() adds.
+// Run it on kernels before and after a change to the copy
+// routines to compare them.
+
+#define FILESIZE (32*1024)
+#define TOTAL (64*1024*1024)
+#define GROW (4*1024*1024)
+
+static char buf[FILESIZE + 8];
+
+static void
+report(char *what, int total, int ticks)
+{
+  if(ticks == 0)
+    ticks = 1;
+  printf("%s: %d KB in %d ticks, %d KB/tick\n", what,
+         total / 1024, ticks, total / 1024 / ticks);
+}
+
+// read the file over and over, into buf + off.
+static void
+readbench(char *what, int off)
+{
+  int fd, start, n;
+
+  start = uptime();
+  for(n = 0; n < TOTAL; n += FILESIZE){
+    if((fd = open("copybench.tmp", O_RDONLY)) < 0){
+      printf("copybench: open failed\n");
+      exit(1);
+    }
+    if(read(fd, buf + off, FILESIZE) != FILESIZE){
+      printf("copybench: read failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  report(what, TOTAL, uptime() - start);
+}
+
+static void
+pipebench(void)
+{
+  int fds[2], start, n, m;
+
+  if(pipe(fds) < 0){
+    printf("copybench: pipe failed\n");
+    exit(1);
+  }
+  start = uptime();
+  if(fork() == 0){
+    close(fds[0]);
+    for(n = 0; n < TOTAL/4; n += FILESIZE)
+      write(fds[1], buf, FILESIZE);
+    exit(0);
+  }
+  close(fds[1]);
+  for(n = 0; (m = read(fds[0], buf, FILESIZE)) > 0; n += m)
+    ;
+  close(fds[0]);
+  wait(0);
+  report("pipe", n, uptime() - start);
+}
+
+static void
+sbrkbench(void)
+{
+  int start, n;
+
+  start = uptime();
+  for(n = 0; n < TOTAL; n += GROW){
+    if(sbrk(GROW) == (char*)-1){
+      printf("copybench: sbrk failed\n");
+      exit(1);
+    }
+    sbrk(-GROW);
+  }
+  report("sbrk zeroing", TOTAL, uptime() - start);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd;
+
+  memset(buf, 'c', sizeof(buf));
+  if((fd = open("copybench.tmp", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, FILESIZE) != FILESIZE){
+    printf("copybench: cannot make copybench.tmp\n");
+    exit(1);
+  }
+  close(fd);
+
+  readbench("read, aligned", 0);
+  readbench("read, unaligned", 1);
+  pipebench();
+  sbrkbench();
+
+  unlink("copybench.tmp");
+  exit(0);
+}
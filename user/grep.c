@@ -2,6 +2,7 @@
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/fcntl.h"
 #include "user/user.h"
 
 char buf[1024];
@@ -55,6 +56,7 @@ main(int argc, char *argv[])
       printf("grep: cannot open %s\n", argv[i]);
       exit(1);
     }
+    fadvise(fd, 0, 0, FADV_SEQUENTIAL);
     grep(pattern, fd);
     close(fd);
   }
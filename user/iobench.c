@@ -0,0 +1,105 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/ioprio.h"
+#include "user/user.h"
+
+// Mixed disk traffic: writer processes stream blocks into files
+// of their own while this process does small file operations,
+// each of which commits to the log and so waits for the disk.
+// How long those take is the interactive latency; how soon the
+// writers finish is the throughput. Run with the writers in
+// each I/O class in turn.
+
+#define NWRITER 3
+#define WBLOCKS 40   // blocks per writer file
+#define WROUNDS 8    // files each writer writes
+#define NSMALL 30    // small operations timed
+
+static char buf[BSIZE];
+
+static void
+writer(int i, int class)
+{
+  char name[] = "iobenchw0";
+  int fd;
+
+  name[8] = '0' + i;
+  ionice(class);
+  for(int r = 0; r < WROUNDS; r++){
+    if((fd = open(name, O_CREATE|O_RDWR|O_TRUNC)) < 0){
+      printf("iobench: cannot create %s\n", name);
+      exit(1);
+    }
+    for(int b = 0; b < WBLOCKS; b++){
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("iobench: write failed\n");
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  unlink(name);
+  exit(0);
+}
+
+// create, write and remove a small file; returns ticks taken.
+static int
+smallop(void)
+{
+  int start = uptime();
+  int fd;
+
+  if((fd = open("iobenchs", O_CREATE|O_RDWR)) < 0){
+    printf("iobench: cannot create iobenchs\n");
+    exit(1);
+  }
+  write(fd, "x", 1);
+  close(fd);
+  unlink("iobenchs");
+  return uptime() - start;
+}
+
+static void
+run(char *what, int class)
+{
+  int i, t, total = 0, max = 0, start;
+
+  start = uptime();
+  for(i = 0; i < NWRITER; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("iobench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      writer(i, class);
+  }
+  for(i = 0; i < NSMALL; i++){
+    t = smallop();
+    total += t;
+    if(t > max)
+      max = t;
+  }
+  for(i = 0; i < NWRITER; i++)
+    wait(0);
+  t = uptime() - start;
+  if(t == 0)
+    t = 1;
+  printf("writers %s: %d small ops in %d ticks, slowest %d; "
+         "%d blocks written in %d ticks, %d per tick\n",
+         what, NSMALL, total, max,
+         NWRITER * WROUNDS * WBLOCKS, t, NWRITER * WROUNDS * WBLOCKS / t);
+}
+
+int
+main(int argc, char *argv[])
+{
+  memset(buf, 'w', sizeof(buf));
+  run("best-effort", IOCLASS_BE);
+  run("idle", IOCLASS_IDLE);
+  ionice(IOCLASS_RT);
+  run("best-effort, this one realtime", IOCLASS_BE);
+  exit(0);
+}
@@ -0,0 +1,99 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// Compare a heap region built from 4096-byte pages with one
+// that the kernel can map with 2 MB megapages: page-table
+// pages needed, and the time to sweep the region with a
+// page-sized stride (one TLB entry per access with 4096-byte
+// pages, one per 512 accesses with megapages).
+
+#define MB (1024*1024)
+#define SIZE (16*MB)
+#define ROUNDS 200
+
+static int
+sweep(char *base, int size)
+{
+  int start = uptime();
+  int sum = 0;
+
+  for(int r = 0; r < ROUNDS; r++)
+    for(char *p = base; p < base + size; p += 4096 + 64)
+      sum += *p;
+  if(sum == -1)
+    printf("impossible\n");
+  return uptime() - start;
+}
+
+static void
+report(char *what, struct memstat *before, struct memstat *after, int ticks)
+{
+  printf("%s: %d page-table pages, %d megapages, %d ticks\n", what,
+         (int)(after->ptpages - before->ptpages),
+         (int)(after->megapages - before->megapages), ticks);
+}
+
+// Grow the heap by SIZE bytes, page by page or in one
+// step from a 2 MB boundary, and sweep it.
+static void
+phase(char *what, int onestep)
+{
+  struct memstat st0, st1;
+  char *base;
+
+  memstat(&st0);
+  base = sbrk(0);
+  if(onestep){
+    sbrk(((uint64)base + 2*MB - 1) / (2*MB) * (2*MB) - (uint64)base);
+    base = sbrk(SIZE);
+    if(base == (char*)-1){
+      printf("megabench: out of memory\n");
+      exit(1);
+    }
+  } else {
+    for(int i = 0; i < SIZE; i += 4096){
+      if(sbrk(4096) == (char*)-1){
+        printf("megabench: out of memory\n");
+        exit(1);
+      }
+    }
+  }
+  memset(base, 1, SIZE);
+  memstat(&st1);
+  report(what, &st0, &st1, sweep(base, SIZE));
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat st;
+
+  if(memstat(&st) < 0){
+    printf("megabench: memstat failed\n");
+    exit(1);
+  }
+  printf("kernel page table: %d page-table pages, %d megapages\n",
+         (int)st.kptpages, (int)st.kmegapages);
+  printf("free: %d pages, %d megapages\n", (int)st.freepages, (int)st.freemega);
+  printf("free blocks by order:");
+  for(int o = 0; o < NORDER; o++)
+    printf(" %d", (int)st.freeblocks[o]);
+  printf("\n");
+
+  // each phase in a fresh child, so that neither
+  // sees page-table pages left behind by the other.
+  if(fork() == 0){
+    phase("4096-byte pages", 0);
+    exit(0);
+  }
+  wait(0);
+  if(fork() == 0){
+    phase("megapages", 1);
+    exit(0);
+  }
+  wait(0);
+
+  exit(0);
+}
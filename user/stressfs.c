@@ -13,6 +13,45 @@
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
 
+#define BENCHKB 256   // size of the benchmark's file
+#define BENCHROUNDS 4 // times it is written for each write size
+
+// "stressfs -b": write a large file sequentially, with writes
+// of several sizes, and report the throughput of each.
+static void
+bench(void)
+{
+  static char buf[64*1024];
+  int sizes[] = { 512, 4*1024, 16*1024, 64*1024 };
+  int fd, i, r, n, t, kbps;
+
+  memset(buf, 'b', sizeof(buf));
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    t = uptime();
+    for(r = 0; r < BENCHROUNDS; r++){
+      fd = open("stressfs.big", O_CREATE | O_TRUNC | O_RDWR);
+      if(fd < 0){
+        printf("stressfs: cannot create stressfs.big\n");
+        exit(1);
+      }
+      for(n = 0; n < BENCHKB*1024; n += sizes[i]){
+        if(write(fd, buf, sizes[i]) != sizes[i]){
+          printf("stressfs: write failed\n");
+          exit(1);
+        }
+      }
+      close(fd);
+    }
+    t = uptime() - t;
+    if(t == 0)
+      t = 1;
+    kbps = BENCHROUNDS * BENCHKB * 10 / t;  // 10 ticks a second
+    printf("%d KB in %d-byte writes: %d ticks, %d.%d MB/s\n",
+           BENCHROUNDS * BENCHKB, sizes[i], t, kbps / 1024, kbps % 1024 * 10 / 1024);
+  }
+  unlink("stressfs.big");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -20,6 +59,11 @@ main(int argc, char *argv[])
   char path[] = "stressfs0";
   char data[512];
 
+  if(argc > 1 && strcmp(argv[1], "-b") == 0){
+    bench();
+    exit(0);
+  }
+
   printf("stressfs starting\n");
   memset(data, 'a', sizeof(data));
 
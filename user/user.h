@@ -1,5 +1,7 @@
 struct stat;
 struct rtcdate;
+struct memstat;
+struct bcstat;
 
 // system calls
 int fork(void);
@@ -26,6 +28,13 @@ int sleep(int);
 int uptime(void);
 int strace(int);
 int setpriority(int, int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int memstat(struct memstat*);
+int ksm(int);
+int bcachestat(struct bcstat*);
+int fadvise(int, int, int, int);
+int ionice(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -7,6 +7,9 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "kernel/bcstat.h"
+#include "kernel/ioprio.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2004,7 +2007,10 @@ dirfile(char *s)
 }
 
 // test that iput() is called at the end of _namei().
-// also tests empty file names.
+// also tests empty file names. each pass uses a fresh
+// directory and removes it; a leaked reference keeps its
+// inode allocated, so leaks run out of in-memory or on-disk
+// inodes long before NINODE + 1 passes.
 void
 iref(char *s)
 {
@@ -2029,12 +2035,11 @@ iref(char *s)
     if(fd >= 0)
       close(fd);
     unlink("xx");
-  }
 
-  // clean up
-  for(i = 0; i < NINODE + 1; i++){
-    chdir("..");
-    unlink("irefd");
+    if(chdir("..") != 0 || unlink("irefd") != 0){
+      printf("%s: unlink irefd failed\n", s);
+      exit(1);
+    }
   }
 
   chdir("/");
@@ -2706,6 +2711,1172 @@ execout(char *s)
   exit(0);
 }
 
+// text pages are read-only and shared between processes
+// running the same binary, so a store to them must fault.
+void
+textwrite(char *s)
+{
+  int pid;
+  int xstatus;
+
+  pid = fork();
+  if(pid == 0){
+    volatile int *addr = (int *) 0;
+    *addr = 10;
+    exit(1);
+  } else if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus == -1)  // kernel killed child?
+    exit(0);
+  else
+    exit(xstatus);
+}
+
+// map a file private and shared, and check that only stores
+// through the shared mapping reach the file.
+void
+mmapfile(char *s)
+{
+  int fd, fd1, i;
+  char *p;
+  enum { SZ = 2*4096 + 100 };
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(p[i] != 'a' + i % 26){
+      printf("%s: wrong byte %d in private mapping\n", s, i);
+      exit(1);
+    }
+  }
+  // the rest of the last page is zero-filled.
+  if(p[SZ] != 0){
+    printf("%s: page not zero-filled\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, SZ) < 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  p[4096] = 'Y';
+  // read() from the file into a page of its own mapping
+  // that has not been touched yet.
+  fd1 = open("mmapfile", O_RDONLY);
+  if(read(fd1, p + 2*4096, 10) != 10){
+    printf("%s: read into mapping failed\n", s);
+    exit(1);
+  }
+  close(fd1);
+  if(munmap(p, SZ) < 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, SZ) != SZ || buf[0] != 'a' || buf[4096] != 'Y' ||
+     buf[2*4096] != 'a'){
+    printf("%s: shared store did not reach the file\n", s);
+    exit(1);
+  }
+  // a read-only file cannot be mapped shared and writable.
+  if(mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED){
+    printf("%s: mmap of read-only file allowed writes\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
+// two processes that map a file MAP_SHARED each on their
+// own see each other's stores at once, and both reach the
+// file. also, mmap() places a mapping at a free address hint.
+void
+mmapcoherent(char *s)
+{
+  int fd, pid, xstatus, fds[2];
+  char *p, *hint, c, buf[8192];
+
+  fd = open("mmapcoh", O_CREATE|O_RDWR);
+  memset(buf, 'a', sizeof(buf));
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: cannot create\n", s);
+    exit(1);
+  }
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED)
+      exit(1);
+    p[100] = 'C';
+    write(fds[1], "x", 1);
+    // wait for the parent's store.
+    for(int i = 0; i < 100 && ((volatile char*)p)[200] != 'P'; i++)
+      sleep(1);
+    exit(p[200] == 'P' ? 0 : 2);
+  }
+  p = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], &c, 1) != 1){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+  if(p[100] != 'C'){
+    printf("%s: store in other mapping not seen\n", s);
+    exit(1);
+  }
+  p[200] = 'P';
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: other mapping did not see store\n", s);
+    exit(1);
+  }
+  if(munmap(p, sizeof(buf)) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  fd = open("mmapcoh", O_RDONLY);
+  if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[100] != 'C' ||
+     buf[200] != 'P' || buf[0] != 'a'){
+    printf("%s: stores did not reach the file\n", s);
+    exit(1);
+  }
+
+  // a free, page-aligned hint is honoured.
+  hint = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(hint == MAP_FAILED || munmap(hint, 4096) < 0){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  p = mmap(hint, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p != hint){
+    printf("%s: free hint not used\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+  close(fd);
+  unlink("mmapcoh");
+}
+
+// shared anonymous memory is shared with children,
+// private anonymous memory is copied.
+void
+mmapanon(char *s)
+{
+  int pid, xstatus;
+  int *shared, *private;
+
+  shared = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  private = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(shared == MAP_FAILED || private == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(shared[0] != 0 || private[0] != 0){
+    printf("%s: anonymous memory not zero\n", s);
+    exit(1);
+  }
+  private[0] = 1;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(private[0] != 1)
+      exit(1);
+    shared[0] = 42;
+    private[0] = 2;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not see private memory\n", s);
+    exit(1);
+  }
+  if(shared[0] != 42){
+    printf("%s: store in child not seen by parent\n", s);
+    exit(1);
+  }
+  if(private[0] != 1){
+    printf("%s: private memory shared with child\n", s);
+    exit(1);
+  }
+}
+
+// memory mapped PROT_EXEC only can't be read, by the
+// process or by the kernel on its behalf.
+void
+mmapexeconly(char *s)
+{
+  int fd, pid, xstatus;
+  char *p;
+
+  p = mmap(0, 4096, PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  fd = open("execonly", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create\n", s);
+    exit(1);
+  }
+  if(write(fd, p, 10) != -1){
+    printf("%s: write() read execute-only memory\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("execonly");
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    printf("%s: load from execute-only memory: %d\n", s, *(volatile char*)p);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: load from execute-only memory not killed\n", s);
+    exit(1);
+  }
+}
+
+// unmap the middle of a mapping, and check that
+// the hole is gone and the rest is still there.
+void
+munmaptest(char *s)
+{
+  int pid, xstatus;
+  char *p;
+
+  p = mmap(0, 3*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  p[0] = 1;
+  p[4096] = 2;
+  p[2*4096] = 3;
+  if(munmap(p + 4096, 4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  if(munmap(p + 4096, 4096) == 0){
+    printf("%s: munmap of a hole succeeded\n", s);
+    exit(1);
+  }
+  if(p[0] != 1 || p[2*4096] != 3){
+    printf("%s: munmap lost data\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[4096] = 4;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: store to unmapped page did not fault\n", s);
+    exit(1);
+  }
+
+  if(munmap(p, 4096) < 0 || munmap(p + 2*4096, 4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+}
+
+// after memory is unmapped and mapped again, the TLB must not
+// still hold the old translation. go around enough times for
+// the kernel to run out of ASIDs and start a new generation.
+void
+tlbstale(char *s)
+{
+  char *a, *b;
+  int i;
+
+  a = sbrk(0);
+  sbrk(PGROUNDUP((uint64)a) - (uint64)a);
+  a = sbrk(0);
+  for(i = 0; i < 70000; i++){
+    // the two physical pages trade places each round.
+    b = sbrk(2*PGSIZE);
+    if(b != a){
+      printf("%s: sbrk returned %p, not %p\n", s, b, a);
+      exit(1);
+    }
+    a[0] = 1;
+    if(a[PGSIZE] != 0){
+      printf("%s: stale translation after %d rounds\n", s, i);
+      exit(1);
+    }
+    a[PGSIZE] = 2;
+    if(a[0] != 1){
+      printf("%s: stale translation after %d rounds\n", s, i);
+      exit(1);
+    }
+    sbrk(-2*PGSIZE);
+  }
+}
+
+// large aligned heap growth and anonymous mappings use
+// megapages; check that fork copies them and that they
+// can be partly unmapped.
+void
+megapage(char *s)
+{
+  struct memstat st;
+  char *a, *p;
+  int pid, xstatus;
+  uint64 i;
+
+  memstat(&st);
+  if(st.freemega < 4){
+    printf("%s: not enough free megapages, skipping\n", s);
+    exit(0);
+  }
+
+  a = sbrk(0);
+  sbrk(MEGAROUNDUP((uint64)a) - (uint64)a);
+  a = sbrk(2*MEGASIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  memstat(&st);
+  if(st.megapages < 2){
+    printf("%s: heap not mapped with megapages\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*MEGASIZE; i += PGSIZE)
+    a[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 2*MEGASIZE; i += PGSIZE)
+      if(a[i] != (char)(i / PGSIZE))
+        exit(1);
+    a[0] = 99;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[0] != 0){
+    printf("%s: fork did not copy megapages\n", s);
+    exit(1);
+  }
+
+  // shrink into the middle of the second megapage.
+  sbrk(-3*PGSIZE);
+  for(i = 0; i < 2*MEGASIZE - 3*PGSIZE; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: lost data splitting a megapage\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, 2*MEGASIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED || ((uint64)p % MEGASIZE) != 0){
+    printf("%s: mmap failed or not aligned\n", s);
+    exit(1);
+  }
+  p[MEGASIZE + 5] = 7;
+  if(munmap(p + MEGASIZE + PGSIZE, PGSIZE) < 0 || p[MEGASIZE + 5] != 7){
+    printf("%s: munmap of part of a megapage failed\n", s);
+    exit(1);
+  }
+  if(munmap(p, MEGASIZE + PGSIZE) < 0 || munmap(p + MEGASIZE + 2*PGSIZE, MEGASIZE - 2*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+}
+
+// more open files in the system than the old fixed file table held.
+void
+manyfiles(char *s)
+{
+  enum { NCHILD = 12, NPIPE = 5 };
+  int ready[2], done[2], fds[2];
+  int i, j, n, xstatus, ok;
+  char c;
+
+  if(pipe(ready) < 0 || pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[0]);
+      close(done[1]);
+      c = 'x';
+      for(j = 0; j < NPIPE; j++)
+        if(pipe(fds) < 0)
+          c = 'f';
+      write(ready[1], &c, 1);
+      // hold the files until the parent has heard from everyone.
+      read(done[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(done[0]);
+
+  ok = 1;
+  for(n = 0; n < NCHILD && read(ready[0], &c, 1) == 1; n++)
+    if(c != 'x')
+      ok = 0;
+  close(done[1]);
+  close(ready[0]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      ok = 0;
+  }
+  if(n != NCHILD || !ok){
+    printf("%s: could not open %d files\n", s, NCHILD * NPIPE * 2);
+    exit(1);
+  }
+}
+
+// more live processes than the old fixed process table held.
+void
+manyprocs(char *s)
+{
+  enum { N = 100 };
+  int fds[2], i, xstatus;
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork %d failed\n", s, i);
+      close(fds[1]);
+      for(; i > 0; i--)
+        wait(0);
+      exit(1);
+    }
+    if(pid == 0){
+      // stay alive until the parent closes the pipe.
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+}
+
+// pages freed one at a time should merge back into megapages.
+void
+buddy(char *s)
+{
+  struct memstat st0, st1;
+  char *a;
+  int i, n = 2*MEGASIZE / PGSIZE;
+
+  memstat(&st0);
+  if(st0.freemega < 4){
+    printf("%s: not enough free megapages, skipping\n", s);
+    exit(0);
+  }
+  for(i = 0; i < n; i++){
+    if((a = sbrk(PGSIZE)) == (char*)-1){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    a[0] = 1;
+  }
+  sbrk(-n*PGSIZE);
+  memstat(&st1);
+  // allow for a page-table page left behind.
+  if(st1.freemega + 1 < st0.freemega){
+    printf("%s: free megapages %d, was %d\n", s, (int)st1.freemega, (int)st0.freemega);
+    exit(1);
+  }
+}
+
+// the words of page i of a swap test. if noisy, the whole
+// page is pseudo-random, so that it does not compress;
+// otherwise only its first word is set.
+static uint64
+swapword(uint64 i, int tag, int w, int noisy)
+{
+  uint64 x = (i << 16) ^ tag ^ ((uint64)w << 40);
+
+  if(!noisy)
+    return w == 0 ? i ^ tag : 0;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+// grow by n pages, a megabyte at a time so that there are no
+// megapages, and fill them in.
+// returns the start, or 0 if sbrk() fails.
+static char *
+swapfill(uint64 n, int tag, int noisy)
+{
+  char *base;
+  uint64 i, chunk = (1 << 20) / PGSIZE;
+  int w;
+
+  base = sbrk(0);
+  for(i = 0; i < n; i += chunk)
+    if(sbrk(chunk * PGSIZE) == (char*)-1)
+      return 0;
+  for(i = 0; i < n; i++)
+    for(w = 0; w < (noisy ? PGSIZE/8 : 1); w++)
+      ((uint64*)(base + i*PGSIZE))[w] = swapword(i, tag, w, noisy);
+  return base;
+}
+
+// returns 0 if the n pages at base are as swapfill() left them.
+static int
+swapcheck(char *base, uint64 n, int tag, int noisy)
+{
+  for(uint64 i = 0; i < n; i++)
+    for(int w = 0; w < PGSIZE/8; w++)
+      if(((uint64*)(base + i*PGSIZE))[w] != swapword(i, tag, w, noisy))
+        return -1;
+  return 0;
+}
+
+// two processes that together need more memory than there is:
+// pages of whichever is waiting should go to swap, and come
+// back intact. pages that compress well stay in memory, the
+// others go to disk.
+static void
+overcommit1(char *s, int noisy)
+{
+  struct memstat st0, st1;
+  int up[2], down[2], pid, xstatus;
+  uint64 n;
+  char *base, c;
+
+  memstat(&st0);
+  if(st0.swapslots - st0.swapused < 1024){
+    printf("%s: not enough swap, skipping\n", s);
+    exit(0);
+  }
+  // each takes a bit over half of free memory.
+  n = st0.freepages / 2 + 512;
+  if(pipe(up) < 0 || pipe(down) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((base = swapfill(n, 0x5a5a, noisy)) == 0){
+      printf("%s: child sbrk failed\n", s);
+      exit(1);
+    }
+    write(up[1], "x", 1);
+    read(down[0], &c, 1);
+    if(swapcheck(base, n, 0x5a5a, noisy) < 0){
+      printf("%s: child memory corrupted\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  if(read(up[0], &c, 1) != 1){
+    wait(0);
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+  if((base = swapfill(n, 0xa5a5, noisy)) == 0){
+    printf("%s: sbrk failed\n", s);
+    write(down[1], "x", 1);
+    wait(0);
+    exit(1);
+  }
+  // the child's pages are out now.
+  memstat(&st1);
+  write(down[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(noisy ? st1.swapused <= st0.swapused : st1.zrampages <= st0.zrampages){
+    printf("%s: nothing went to %s\n", s, noisy ? "disk" : "zram");
+    exit(1);
+  }
+  if(!noisy && st1.zrambytes * 2 > st1.zrampages * PGSIZE){
+    printf("%s: pages did not compress\n", s);
+    exit(1);
+  }
+  if(swapcheck(base, n, 0xa5a5, noisy) < 0){
+    printf("%s: memory corrupted\n", s);
+    exit(1);
+  }
+  memstat(&st1);
+  if(st1.swapouts == st0.swapouts || st1.swapins == st0.swapins){
+    printf("%s: nothing was swapped\n", s);
+    exit(1);
+  }
+}
+
+void
+overcommit(char *s)
+{
+  overcommit1(s, 0);
+}
+
+void
+overcommitdisk(char *s)
+{
+  overcommit1(s, 1);
+}
+
+// identical pages of a process that asked for ksm() should
+// come to share frames, and get their own again on a store.
+void
+ksmmerge(char *s)
+{
+  enum { N = 64 };
+  struct memstat st;
+  char *a;
+  int i, t;
+
+  ksm(1);
+  if((a = sbrk(N*PGSIZE)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    memset(a + i*PGSIZE, 0x6b, PGSIZE);
+  // ksmd only looks at processes that are not running.
+  for(t = 0; t < 300; t++){
+    memstat(&st);
+    if(st.ksmsaved >= N/2)
+      break;
+    sleep(1);
+  }
+  if(t == 300){
+    printf("%s: pages were not merged\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    a[i*PGSIZE] = i;
+  for(i = 0; i < N; i++){
+    if(a[i*PGSIZE] != (char)i || a[i*PGSIZE + 1] != 0x6b){
+      printf("%s: page %d wrong after store\n", s, i);
+      exit(1);
+    }
+  }
+  ksm(0);
+}
+
+// copyin() and copyout() at every alignment, across pages,
+// and copyinstr() of names that end anywhere in a word.
+void
+copyalign(char *s)
+{
+  static char src[3*4096+16], dst[3*4096+16];
+  char name[24];
+  int fd, i, off, n;
+
+  for(i = 0; i < sizeof(src); i++)
+    src[i] = i * 7 + (i >> 8);
+  for(off = 0; off < 16; off++){
+    n = 2*4096 + 3*off + 1;
+    fd = open("copyalign", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    if(write(fd, src + off, n) != n){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    memset(dst, 0, sizeof(dst));
+    fd = open("copyalign", O_RDONLY);
+    if(read(fd, dst + 15 - off, n) != n){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(memcmp(dst + 15 - off, src + off, n) != 0){
+      printf("%s: wrong data at offset %d\n", s, off);
+      exit(1);
+    }
+  }
+  unlink("copyalign");
+
+  for(n = 2; n < 14; n++){
+    for(i = 0; i < n; i++)
+      name[i] = 'a' + i;
+    name[n] = 0;
+    fd = open(name + (n & 1), O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: open %s failed\n", s, name + (n & 1));
+      exit(1);
+    }
+    close(fd);
+    if(unlink(name + (n & 1)) < 0){
+      printf("%s: unlink %s failed\n", s, name + (n & 1));
+      exit(1);
+    }
+  }
+}
+
+// the kernel copies to and from user memory through the
+// process's kernel page table: it must see memory that sbrk()
+// has just added, and not the stack guard page or memory that
+// sbrk() has just taken away.
+void
+kvmcopy(char *s)
+{
+  char *guard, *a;
+  int fds[2];
+  uint64 n = 3*1024*1024;
+
+  guard = (char *) ((r_sp() & ~(PGSIZE-1)) - PGSIZE);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "kvmcopy", 8) != 8){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], guard, 8) != -1){
+    printf("%s: read into the guard page worked\n", s);
+    exit(1);
+  }
+  if(write(fds[1], guard, 8) > 0){
+    printf("%s: write from the guard page worked\n", s);
+    exit(1);
+  }
+
+  a = sbrk(n);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  // the failed read above took what was in the pipe.
+  if(write(fds[1], "kvmcopy", 8) != 8){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], a + n - 8, 8) != 8 || strcmp(a + n - 8, "kvmcopy") != 0){
+    printf("%s: read into new memory failed\n", s);
+    exit(1);
+  }
+  sbrk(-n);
+  if(write(fds[1], "kvmcopy", 8) != 8){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], a + n - 8, 8) != -1){
+    printf("%s: read into freed memory worked\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// wait() leaves a child's memory to the reaper threads; a
+// process that needs it must get it without waiting for them.
+void
+reapmem(char *s)
+{
+  int i, pid, xstatus;
+  int n = 32*1024*1024;
+  char *a, *p;
+
+  for(i = 0; i < 20; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      a = sbrk(n);
+      if(a == (char*)0xffffffffffffffffL)
+        exit(1);
+      for(p = a; p < a + n; p += PGSIZE)
+        *p = i;
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child %d could not allocate\n", s, i);
+      exit(1);
+    }
+  }
+}
+
+// many children exit at once, some of them big, so that
+// wait() frees zombies while the reapers are busy.
+void
+reapmany(char *s)
+{
+  int i, j, pid, xstatus, n = 20;
+  char *a;
+
+  for(j = 0; j < 5; j++){
+    for(i = 0; i < n; i++){
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid == 0){
+        if(i % 4 == 0 && (a = sbrk(1024*1024)) != (char*)0xffffffffffffffffL)
+          for(char *p = a; p < a + 1024*1024; p += PGSIZE)
+            *p = i;
+        exit(i);
+      }
+    }
+    for(i = 0; i < n; i++){
+      if(wait(&xstatus) < 0 || xstatus < 0 || xstatus >= n){
+        printf("%s: wait failed\n", s);
+        exit(1);
+      }
+    }
+    if(wait(0) != -1){
+      printf("%s: extra child\n", s);
+      exit(1);
+    }
+  }
+}
+
+// a file several times the size of the boot-time buffer cache
+// should stay cached once read, since the cache grows into
+// free memory; a second read of it should mostly hit.
+void
+bcachegrow(char *s)
+{
+  struct bcstat st0, st1, st2;
+  static char buf[BSIZE];
+  int fd, i, n;
+
+  if(bcachestat(&st0) < 0){
+    printf("%s: bcachestat failed\n", s);
+    exit(1);
+  }
+  if(st0.nbuf < st0.minbuf || st0.nbuf > st0.maxbuf){
+    printf("%s: %d buffers, not in [%d, %d]\n", s,
+           (int)st0.nbuf, (int)st0.minbuf, (int)st0.maxbuf);
+    exit(1);
+  }
+  n = 3 * st0.minbuf;
+  if(n > MAXFILE - 8)
+    n = MAXFILE - 8;
+  if(st0.nbuf + n > st0.maxbuf){
+    printf("%s: cache cannot grow, skipping\n", s);
+    exit(0);
+  }
+
+  fd = open("bcachegrow", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create\n", s);
+    exit(1);
+  }
+  memset(buf, 'g', sizeof(buf));
+  for(i = 0; i < n; i++){
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(int pass = 0; pass < 2; pass++){
+    bcachestat(&st1);
+    fd = open("bcachegrow", O_RDONLY);
+    for(i = 0; i < n; i++){
+      if(read(fd, buf, BSIZE) != BSIZE || buf[0] != 'g'){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  bcachestat(&st2);
+  unlink("bcachegrow");
+
+  if(st2.grows == st0.grows){
+    printf("%s: cache did not grow\n", s);
+    exit(1);
+  }
+  if(st2.misses - st1.misses >= n / 2){
+    printf("%s: %d of %d blocks missed on the second read\n", s,
+           (int)(st2.misses - st1.misses), n);
+    exit(1);
+  }
+}
+
+// read a file with each fadvise() hint, starting over now and
+// then, checking that read-ahead never hands back wrong data.
+void
+readahead(char *s)
+{
+  static char buf[BSIZE];
+  int advice[] = { FADV_NORMAL, FADV_SEQUENTIAL, FADV_RANDOM, FADV_WILLNEED };
+  int fds[2], fd, i, a, n = 100;
+
+  fd = open("readahead", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    memset(buf, 'a' + i % 26, sizeof(buf));
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(a = 0; a < 4; a++){
+    fd = open("readahead", O_RDONLY);
+    if(fadvise(fd, 0, 0, advice[a]) < 0){
+      printf("%s: fadvise(%d) failed\n", s, advice[a]);
+      exit(1);
+    }
+    for(i = 0; i < n; i++){
+      // start over, and catch up to block i+1.
+      if(i % 17 == 16){
+        close(fd);
+        fd = open("readahead", O_RDONLY);
+        for(int j = 0; j <= i; j++)
+          read(fd, buf, BSIZE);
+        i++;
+        if(i >= n)
+          break;
+      }
+      if(read(fd, buf, BSIZE) != BSIZE ||
+         buf[0] != 'a' + i % 26 || buf[BSIZE-1] != 'a' + i % 26){
+        printf("%s: block %d wrong with advice %d\n", s, i, advice[a]);
+        exit(1);
+      }
+    }
+    if(read(fd, buf, BSIZE) != 0){
+      printf("%s: read past the end\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  if(fadvise(0, 0, 0, 99) == 0 || pipe(fds) < 0 ||
+     fadvise(fds[0], 0, 0, FADV_SEQUENTIAL) == 0){
+    printf("%s: fadvise accepted a bad hint or a pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("readahead");
+}
+
+// ionice() sets the I/O class, which children inherit,
+// and file I/O works in every class.
+void
+ionicetest(char *s)
+{
+  int pid, xstatus;
+
+  if(ionice(0) != IOCLASS_BE){
+    printf("%s: default class is not best-effort\n", s);
+    exit(1);
+  }
+  if(ionice(4) != -1 || ionice(-1) != -1){
+    printf("%s: ionice accepted a bad class\n", s);
+    exit(1);
+  }
+  for(int c = IOCLASS_RT; c <= IOCLASS_IDLE; c++){
+    ionice(c);
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      char buf[BSIZE];
+      int fd;
+
+      if(ionice(0) != c)
+        exit(1);
+      if((fd = open("ionice", O_CREATE|O_RDWR)) < 0)
+        exit(1);
+      memset(buf, c, sizeof(buf));
+      for(int i = 0; i < 8; i++)
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+          exit(1);
+      close(fd);
+      if((fd = open("ionice", O_RDONLY)) < 0)
+        exit(1);
+      for(int i = 0; i < 8; i++)
+        if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != c)
+          exit(1);
+      close(fd);
+      unlink("ionice");
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: class %d child failed\n", s, c);
+      exit(1);
+    }
+  }
+  ionice(IOCLASS_BE);
+}
+
+// file data is written in place, not logged. have it land in
+// blocks that a directory, which is logged, has just freed,
+// in writes that end mid-block, and read it back.
+void
+ordered(char *s)
+{
+  static char buf[BSIZE+7];
+  char name[16];
+  struct stat st;
+  int fd, i, j, n = 30;
+
+  if(mkdir("ordered.d") < 0 || (fd = open("ordered.f", O_CREATE|O_RDWR)) < 0){
+    printf("%s: cannot create\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < 128; i++){
+    name[0] = 'a' + i / 26 % 26;
+    name[1] = 'a' + i % 26;
+    name[2] = 0;
+    strcpy(buf, "ordered.d/");
+    strcpy(buf + strlen(buf), name);
+    if(link("ordered.f", buf) < 0){
+      printf("%s: link failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 128; i++){
+    name[0] = 'a' + i / 26 % 26;
+    name[1] = 'a' + i % 26;
+    name[2] = 0;
+    strcpy(buf, "ordered.d/");
+    strcpy(buf + strlen(buf), name);
+    unlink(buf);
+  }
+  if(unlink("ordered.d") < 0){
+    printf("%s: unlink dir failed\n", s);
+    exit(1);
+  }
+
+  fd = open("ordered.f", O_RDWR);
+  for(i = 0; i < n; i++){
+    memset(buf, 'a' + i % 26, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  if(fstat(fd, &st) < 0 || st.size != n * sizeof(buf)){
+    printf("%s: wrong size\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("ordered.f", O_RDONLY);
+  for(i = 0; i < n; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < sizeof(buf); j++){
+      if(buf[j] != 'a' + i % 26){
+        printf("%s: write %d byte %d wrong\n", s, i, j);
+        exit(1);
+      }
+    }
+  }
+  if(read(fd, buf, sizeof(buf)) != 0){
+    printf("%s: read past the end\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("ordered.f");
+}
+
 //
 // use sbrk() to count how many free physical memory pages there are.
 // touches the pages to force allocation.
@@ -2880,6 +4051,28 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {textwrite, "textwrite"},
+    {mmapfile, "mmapfile"},
+    {mmapcoherent, "mmapcoherent"},
+    {mmapanon, "mmapanon"},
+    {mmapexeconly, "mmapexeconly"},
+    {munmaptest, "munmaptest"},
+    {megapage, "megapage"},
+    {tlbstale, "tlbstale"},
+    {manyfiles, "manyfiles"},
+    {manyprocs, "manyprocs"},
+    {buddy, "buddy"},
+    {overcommit, "overcommit"},
+    {overcommitdisk, "overcommitdisk"},
+    {ksmmerge, "ksmmerge"},
+    {copyalign, "copyalign"},
+    {kvmcopy, "kvmcopy"},
+    {reapmem, "reapmem"},
+    {reapmany, "reapmany"},
+    {bcachegrow, "bcachegrow"},
+    {readahead, "readahead"},
+    {ionicetest, "ionice"},
+    {ordered, "ordered"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
@@ -39,3 +39,10 @@ entry("uptime");
 entry("strace");
 entry("waitx");
 entry("setpriority");
+entry("mmap");
+entry("munmap");
+entry("memstat");
+entry("ksm");
+entry("bcachestat");
+entry("fadvise");
+entry("ionice");
@@ -1,5 +1,6 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/fcntl.h"
 #include "user/user.h"
 
 char buf[512];
@@ -47,6 +48,7 @@ main(int argc, char *argv[])
       printf("wc: cannot open %s\n", argv[i]);
       exit(1);
     }
+    fadvise(fd, 0, 0, FADV_SEQUENTIAL);
     wc(fd, argv[i]);
     close(fd);
   }